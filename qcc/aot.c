@@ -0,0 +1,284 @@
+#include "aot.h"
+#include <string.h>
+#include "compiler.h"
+#include "import.h"
+#include "sysexits.h"
+
+#define VECTOR_AS_FUNCTIONS(vect) VECTOR_AS(vect, ObjFunction*)
+
+static void collect_functions(Vector* functions, ObjFunction* func);
+static void collect_value(Vector* functions, Value value);
+static uint32_t chunk_checksum(const Chunk* chunk);
+static void emit_source(FileImport file, void* ctx);
+static void emit_string(FILE* out, const char* str, int length);
+static void emit_function(FILE* out, ObjFunction* func, int index);
+static int emit_instruction(FILE* out, const Chunk* chunk, int offset);
+static bool attach_functions(const AotProgram* program, ObjFunction* main_func);
+
+// Both the translator and the translated program find the functions in the
+// same order: depth first through constants and properties.
+static void collect_functions(Vector* functions, ObjFunction* func) {
+    ObjFunction** collected = VECTOR_AS_FUNCTIONS(functions);
+    for (uint32_t i = 0; i < functions->size; i++) {
+        if (collected[i] == func) {
+            return;
+        }
+    }
+    VECTOR_ADD(functions, func, ObjFunction*);
+    for (int i = 0; i < func->obj.props.size; i++) {
+        collect_value(functions, func->obj.props.values[i]);
+    }
+    for (int i = 0; i < func->chunk.constants.size; i++) {
+        collect_value(functions, func->chunk.constants.values[i]);
+    }
+}
+
+static void collect_value(Vector* functions, Value value) {
+    if (! VALUE_IS_OBJ(value) || VALUE_AS_OBJ(value) == NULL) {
+        return;
+    }
+    Obj* obj = VALUE_AS_OBJ(value);
+    if (OBJ_IS_FUNCTION(obj)) {
+        collect_functions(functions, OBJ_AS_FUNCTION(obj));
+        return;
+    }
+    for (int i = 0; i < obj->props.size; i++) {
+        collect_value(functions, obj->props.values[i]);
+    }
+}
+
+static uint32_t chunk_checksum(const Chunk* chunk) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < chunk->size; i++) {
+        hash = (hash ^ chunk->code[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void aot_emit_c(FILE* out, ObjFunction* main_func) {
+    Vector functions;
+    init_vector(&functions, sizeof(ObjFunction*));
+    collect_functions(&functions, main_func);
+    ObjFunction** collected = VECTOR_AS_FUNCTIONS(&functions);
+
+    fprintf(out, "// Generated by quartz --emit-c. Do not edit.\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    fprintf(out, "static const AotSource sources[] = {\n");
+    import_for_each_file(emit_source, out);
+    fprintf(out, "};\n");
+    for (uint32_t i = 0; i < functions.size; i++) {
+        emit_function(out, collected[i], i);
+    }
+    fprintf(out, "\nstatic const AotFunction functions[] = {\n");
+    for (uint32_t i = 0; i < functions.size; i++) {
+        const Chunk* chunk = &collected[i]->chunk;
+        fprintf(out, "    { qz_function_%u, %d, %uu },\n", i, chunk->size, chunk_checksum(chunk));
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "int main() {\n");
+    fprintf(out, "    AotProgram program = {\n");
+    fprintf(out, "        .sources = sources,\n");
+    fprintf(out, "        .source_count = sizeof(sources) / sizeof(AotSource),\n");
+    fprintf(out, "        .functions = functions,\n");
+    fprintf(out, "        .function_count = %u,\n", functions.size);
+    fprintf(out, "    };\n");
+    fprintf(out, "    return aot_main(&program);\n");
+    fprintf(out, "}\n");
+    free_vector(&functions);
+}
+
+static void emit_source(FileImport file, void* ctx) {
+    FILE* out = (FILE*) ctx;
+    fprintf(out, "    {\n        ");
+    emit_string(out, file.path, file.path_length);
+    fprintf(out, ",\n        ");
+    emit_string(out, file.source, strlen(file.source));
+    fprintf(out, "\n    },\n");
+}
+
+// Writes a string literal, one source line per line.
+static void emit_string(FILE* out, const char* str, int length) {
+    bool line_start = true;
+    for (int i = 0; i < length; i++) {
+        unsigned char c = str[i];
+        if (line_start) {
+            fprintf(out, (i == 0) ? "\"" : "\n        \"");
+            line_start = false;
+        }
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fprintf(out, "\\n\"");
+            line_start = true;
+        } else if (c < ' ' || c >= 0x7F) {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    if (! line_start) {
+        fputc('"', out);
+    } else if (length == 0) {
+        fprintf(out, "\"\"");
+    }
+}
+
+static void emit_function(FILE* out, ObjFunction* func, int index) {
+    const Chunk* chunk = &func->chunk;
+    fprintf(out, "\n// %.*s\n", func->name->length, func->name->chars);
+    fprintf(out, "static int qz_function_%d(JitState* state, int pc) {\n", index);
+    fprintf(out, "    AOT_PROLOGUE();\n");
+    fprintf(out, "    switch (pc) {\n");
+    for (int offset = 0; offset < chunk->size; offset += opcode_length(chunk->code[offset])) {
+        fprintf(out, "    case %d: goto L%d;\n", offset, offset);
+    }
+    // Jumps can land right after the last instruction
+    fprintf(out, "    case %d: goto L%d;\n", chunk->size, chunk->size);
+    fprintf(out, "    default: return pc;\n");
+    fprintf(out, "    }\n");
+    int offset = 0;
+    while (offset < chunk->size) {
+        fprintf(out, "L%d: ", offset);
+        offset = emit_instruction(out, chunk, offset);
+    }
+    fprintf(out, "L%d: AOT_EXIT(%d);\n", offset, offset);
+    fprintf(out, "}\n");
+}
+
+// Writes the statement for the instruction at offset and returns the
+// offset of the next one.
+static int emit_instruction(FILE* out, const Chunk* chunk, int offset) {
+    const uint8_t* code = chunk->code;
+    uint8_t op = code[offset];
+    int next = offset + opcode_length(op);
+#define BYTE(n) (code[offset + (n)])
+#define LONG(n) ((uint16_t) ((code[offset + (n)] << 8) | code[offset + (n) + 1]))
+#define EMIT(...) fprintf(out, __VA_ARGS__)
+
+    switch (op) {
+    case OP_ADD_NUM: EMIT("AOT_NUM_BINARY(+);\n"); break;
+    case OP_SUB: EMIT("AOT_NUM_BINARY(-);\n"); break;
+    case OP_MUL: EMIT("AOT_NUM_BINARY(*);\n"); break;
+    case OP_DIV: EMIT("AOT_NUM_BINARY(/);\n"); break;
+    case OP_MOD: EMIT("AOT_MOD();\n"); break;
+    case OP_NEGATE: EMIT("AOT_NEGATE();\n"); break;
+    case OP_CONCAT_STR: EMIT("AOT_CONCAT();\n"); break;
+    case OP_NOT: EMIT("AOT_NOT();\n"); break;
+    case OP_AND: EMIT("AOT_BOOL_BINARY(&&);\n"); break;
+    case OP_OR: EMIT("AOT_BOOL_BINARY(||);\n"); break;
+    case OP_EQUAL: EMIT("AOT_EQUAL(true);\n"); break;
+    case OP_EQUAL_NUM: EMIT("AOT_NUM_COMPARE(==);\n"); break;
+    case OP_EQUAL_BOOL: EMIT("AOT_BOOL_BINARY(==);\n"); break;
+    case OP_EQUAL_REF: EMIT("AOT_REF_COMPARE(true);\n"); break;
+    case OP_NOT_EQUAL: EMIT("AOT_EQUAL(false);\n"); break;
+    case OP_NOT_EQUAL_NUM: EMIT("AOT_NUM_COMPARE(!=);\n"); break;
+    case OP_NOT_EQUAL_BOOL: EMIT("AOT_BOOL_BINARY(!=);\n"); break;
+    case OP_NOT_EQUAL_REF: EMIT("AOT_REF_COMPARE(false);\n"); break;
+    case OP_GREATER: EMIT("AOT_NUM_COMPARE(>);\n"); break;
+    case OP_LOWER: EMIT("AOT_NUM_COMPARE(<);\n"); break;
+    case OP_GREATER_EQUAL: EMIT("AOT_NUM_COMPARE(>=);\n"); break;
+    case OP_LOWER_EQUAL: EMIT("AOT_NUM_COMPARE(<=);\n"); break;
+    case OP_TRUE: EMIT("AOT_PUSH(BOOL_VALUE(true));\n"); break;
+    case OP_FALSE: EMIT("AOT_PUSH(BOOL_VALUE(false));\n"); break;
+    case OP_NIL: EMIT("AOT_PUSH(NIL_VALUE());\n"); break;
+    case OP_NOP: EMIT(";\n"); break;
+    case OP_POP: EMIT("stack_top--;\n"); break;
+    case OP_CONSTANT: EMIT("AOT_PUSH(constants[%d]);\n", BYTE(1)); break;
+    case OP_CONSTANT_LONG: EMIT("AOT_PUSH(constants[%d]);\n", LONG(1)); break;
+    case OP_DEFINE_GLOBAL: EMIT("globals[%d] = AOT_POP();\n", BYTE(1)); break;
+    case OP_DEFINE_GLOBAL_LONG: EMIT("globals[%d] = AOT_POP();\n", LONG(1)); break;
+    case OP_GET_GLOBAL: EMIT("AOT_PUSH(globals[%d]);\n", BYTE(1)); break;
+    case OP_GET_GLOBAL_LONG: EMIT("AOT_PUSH(globals[%d]);\n", LONG(1)); break;
+    case OP_SET_GLOBAL: EMIT("globals[%d] = AOT_PEEK(0);\n", BYTE(1)); break;
+    case OP_SET_GLOBAL_LONG: EMIT("globals[%d] = AOT_PEEK(0);\n", LONG(1)); break;
+    case OP_GET_LOCAL: EMIT("AOT_PUSH(slots[%d]);\n", BYTE(1)); break;
+    case OP_SET_LOCAL: EMIT("slots[%d] = AOT_PEEK(0);\n", BYTE(1)); break;
+    case OP_GET_LOCALS:
+        EMIT("AOT_PUSH(slots[%d]); AOT_PUSH(slots[%d]);\n", BYTE(1), BYTE(2));
+        break;
+    case OP_GET_LOCAL_CONSTANT:
+        EMIT("AOT_PUSH(slots[%d]); AOT_PUSH(constants[%d]);\n", BYTE(1), BYTE(2));
+        break;
+    case OP_SET_LOCAL_POP: EMIT("slots[%d] = AOT_POP();\n", BYTE(1)); break;
+    case OP_INCREMENT_LOCAL: EMIT("AOT_INCREMENT_LOCAL(%d, %d);\n", BYTE(1), BYTE(2)); break;
+    case OP_GET_UPVALUE: EMIT("AOT_GET_UPVALUE(%d);\n", BYTE(1)); break;
+    case OP_SET_UPVALUE: EMIT("AOT_SET_UPVALUE(%d);\n", BYTE(1)); break;
+    case OP_CLOSURE: EMIT("AOT_CLOSURE(%d);\n", LONG(1)); break;
+    case OP_CLOSE_UPVALUES: EMIT("AOT_CLOSE_UPVALUES(%d);\n", BYTE(1)); break;
+    case OP_JUMP: EMIT("goto L%d;\n", next + LONG(1)); break;
+    case OP_LOOP: EMIT("AOT_LOOP(L%d, %d);\n", next - LONG(1), offset); break;
+    case OP_JUMP_IF_FALSE: EMIT("AOT_JUMP_IF_FALSE(L%d);\n", next + LONG(1)); break;
+    case OP_JUMP_IF_NOT_LOWER: EMIT("AOT_JUMP_IF_NOT(<, L%d);\n", next + LONG(1)); break;
+    case OP_JUMP_IF_NOT_LOWER_EQUAL: EMIT("AOT_JUMP_IF_NOT(<=, L%d);\n", next + LONG(1)); break;
+    case OP_JUMP_IF_NOT_GREATER: EMIT("AOT_JUMP_IF_NOT(>, L%d);\n", next + LONG(1)); break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: EMIT("AOT_JUMP_IF_NOT(>=, L%d);\n", next + LONG(1)); break;
+    case OP_JUMP_IF_NOT_EQUAL: EMIT("AOT_JUMP_IF_NOT(==, L%d);\n", next + LONG(1)); break;
+    case OP_JUMP_IF_EQUAL: EMIT("AOT_JUMP_IF_NOT(!=, L%d);\n", next + LONG(1)); break;
+    case OP_NEW: EMIT("AOT_NEW();\n"); break;
+    case OP_GET_PROP: EMIT("AOT_GET_PROP(%d);\n", BYTE(1)); break;
+    case OP_SET_PROP: EMIT("AOT_SET_PROP(%d);\n", BYTE(1)); break;
+    case OP_BINDED_METHOD: EMIT("AOT_BINDED_METHOD(%d);\n", BYTE(1)); break;
+    case OP_ARRAY: EMIT("AOT_ARRAY(%d);\n", BYTE(1)); break;
+    case OP_ARRAY_PUSH: EMIT("AOT_ARRAY_PUSH();\n"); break;
+    case OP_CAST: EMIT("AOT_CAST(%d);\n", BYTE(1)); break;
+    default:
+        // Calls, returns and invocations are done by the interpreter
+        EMIT("AOT_EXIT(%d);\n", offset);
+        break;
+    }
+#undef BYTE
+#undef LONG
+#undef EMIT
+    return next;
+}
+
+int aot_main(const AotProgram* program) {
+    init_module_system();
+    for (int i = 0; i < program->source_count; i++) {
+        const AotSource* source = &program->sources[i];
+        import_preload(source->path, strlen(source->path), source->source);
+    }
+    const char* main_path = program->sources[0].path;
+    Import main = import(main_path, strlen(main_path));
+    assert(!main.is_native);
+
+    int exit_code = 0;
+    ObjFunction* main_func;
+    init_qvm();
+    qvm.jit = true;
+    if (compile(main.file, &main_func) != COMPILATION_OK) {
+        exit_code = EX_DATAERR;
+    } else if (! attach_functions(program, main_func)) {
+        fprintf(stderr, "The translated code does not match the embedded sources\n");
+        exit_code = EX_SOFTWARE;
+    } else {
+        qvm_execute(main_func);
+    }
+    free_qvm();
+    free_module_system();
+    return exit_code;
+}
+
+static bool attach_functions(const AotProgram* program, ObjFunction* main_func) {
+    Vector functions;
+    init_vector(&functions, sizeof(ObjFunction*));
+    collect_functions(&functions, main_func);
+    ObjFunction** collected = VECTOR_AS_FUNCTIONS(&functions);
+    bool matches = functions.size == (uint32_t) program->function_count;
+    for (uint32_t i = 0; matches && i < functions.size; i++) {
+        const AotFunction* translated = &program->functions[i];
+        const Chunk* chunk = &collected[i]->chunk;
+        matches = translated->size == chunk->size && translated->checksum == chunk_checksum(chunk);
+    }
+    for (uint32_t i = 0; matches && i < functions.size; i++) {
+        JitCode* code = (JitCode*) malloc(sizeof(JitCode));
+        if (code == NULL) {
+            exit(1);
+        }
+        code->entry = program->functions[i].entry;
+        code->entries = NULL;
+        collected[i]->jit = code;
+    }
+    free_vector(&functions);
+    return matches;
+}
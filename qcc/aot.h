@@ -0,0 +1,252 @@
+#ifndef QUARTZ_AOT_H_
+#define QUARTZ_AOT_H_
+
+// Ahead of time translation to C, with --emit-c. Every function of the
+// program becomes a C function with the entry protocol of the JIT (see
+// jit.h): it runs from a bytecode offset on the same stack and slots as the
+// interpreter and returns the offset the interpreter has to continue with.
+// Calls, returns and method invocations go back to the interpreter, which
+// enters the native code of the callee right away. The generated file
+// embeds the sources of the program, that are compiled again at startup to
+// build the constants, classes and types the code works with.
+//
+//   ./quartz --emit-c program.qz > program.c
+//   make libquartz
+//   cc -O3 -iquote <qcc dir> program.c libquartz.a -lm -pthread -o program
+
+#include <math.h>
+#include "common.h"
+#include "vm.h"
+#include "jit.h"
+
+typedef struct {
+    const char* path;
+    const char* source;
+} AotSource;
+
+typedef struct {
+    JitEntry entry;
+    int size; // Size and checksum of the chunk the code was generated from
+    uint32_t checksum;
+} AotFunction;
+
+typedef struct {
+    const AotSource* sources; // The first one is the main file
+    int source_count;
+    const AotFunction* functions; // Depth first, see collect_functions in aot.c
+    int function_count;
+} AotProgram;
+
+// Writes the C translation of the compiled program to out.
+void aot_emit_c(FILE* out, ObjFunction* main_func);
+// Runs a translated program. Returns the exit code of the process.
+int aot_main(const AotProgram* program);
+
+// Used by the generated code. Locals mirror the ones of run() in vm.c.
+
+#define AOT_PROLOGUE()\
+    Value* slots = state->slots;\
+    Value* stack_top = state->stack_top;\
+    Value* constants = state->constants;\
+    Value* globals = state->globals;\
+    ObjFunction* func = state->func;\
+    ObjClosure* closure = state->closure;\
+    (void) slots;\
+    (void) constants;\
+    (void) globals;\
+    (void) func;\
+    (void) closure
+
+#define AOT_PUSH(val) (*(stack_top++) = (val))
+#define AOT_POP() (*(--stack_top))
+#define AOT_PEEK(distance) (*(stack_top - (distance) - 1))
+#define AOT_TYPE(index) (VECTOR_AS_TYPES(&func->chunk.types)[index])
+
+// Like STORE_STATE, before allocations and errors.
+#define AOT_STORE() (qvm.stack_top = stack_top)
+
+#define AOT_EXIT(offset)\
+    do {\
+        state->stack_top = stack_top;\
+        return offset;\
+    } while (false)
+
+#define AOT_NUM_BINARY(op)\
+    do {\
+        double b = VALUE_AS_NUMBER(AOT_POP());\
+        double a = VALUE_AS_NUMBER(AOT_PEEK(0));\
+        AOT_PEEK(0) = NUMBER_VALUE(a op b);\
+    } while (false)
+
+#define AOT_MOD()\
+    do {\
+        double b = VALUE_AS_NUMBER(AOT_POP());\
+        double a = VALUE_AS_NUMBER(AOT_PEEK(0));\
+        AOT_PEEK(0) = NUMBER_VALUE(fmod(a, b));\
+    } while (false)
+
+#define AOT_NEGATE()\
+    do {\
+        double d = VALUE_AS_NUMBER(AOT_PEEK(0));\
+        AOT_PEEK(0) = NUMBER_VALUE(d * -1);\
+    } while (false)
+
+#define AOT_NUM_COMPARE(op)\
+    do {\
+        double b = VALUE_AS_NUMBER(AOT_POP());\
+        double a = VALUE_AS_NUMBER(AOT_PEEK(0));\
+        AOT_PEEK(0) = BOOL_VALUE(a op b);\
+    } while (false)
+
+#define AOT_BOOL_BINARY(op)\
+    do {\
+        bool b = VALUE_AS_BOOL(AOT_POP());\
+        bool a = VALUE_AS_BOOL(AOT_PEEK(0));\
+        AOT_PEEK(0) = BOOL_VALUE(a op b);\
+    } while (false)
+
+#define AOT_REF_COMPARE(same)\
+    do {\
+        Value b = AOT_POP();\
+        AOT_PEEK(0) = BOOL_VALUE(VALUE_SAME(AOT_PEEK(0), b) == (same));\
+    } while (false)
+
+#define AOT_NOT()\
+    do {\
+        bool a = VALUE_AS_BOOL(AOT_PEEK(0));\
+        AOT_PEEK(0) = BOOL_VALUE(!a);\
+    } while (false)
+
+#define AOT_EQUAL(equals)\
+    do {\
+        Value b = AOT_POP();\
+        Value a = AOT_POP();\
+        bool result = value_equals(a, b);\
+        AOT_PUSH(BOOL_VALUE(result == equals));\
+    } while (false)
+
+#define AOT_CONCAT()\
+    do {\
+        AOT_STORE();\
+        ObjString* b = OBJ_AS_STRING(VALUE_AS_OBJ(AOT_PEEK(0)));\
+        ObjString* a = OBJ_AS_STRING(VALUE_AS_OBJ(AOT_PEEK(1)));\
+        ObjString* concat = concat_string(a, b);\
+        stack_top -= 2;\
+        AOT_PUSH(OBJ_VALUE(concat));\
+    } while (false)
+
+#define AOT_INCREMENT_LOCAL(slot, constant)\
+    (slots[slot] = NUMBER_VALUE(VALUE_AS_NUMBER(slots[slot]) + VALUE_AS_NUMBER(constants[constant])))
+
+#define AOT_GET_UPVALUE(index) AOT_PUSH(*closure->upvalues[index]->location)
+#define AOT_SET_UPVALUE(index)\
+    do {\
+        ObjUpvalue* upvalue = closure->upvalues[index];\
+        *upvalue->location = AOT_PEEK(0);\
+        qvm_write_barrier((Obj*) upvalue, AOT_PEEK(0));\
+    } while (false)
+
+// The frame has room for the push (see enter_frame), so it cannot move the stack.
+#define AOT_CLOSURE(constant)\
+    do {\
+        AOT_STORE();\
+        qvm_push_closure(OBJ_AS_FUNCTION(VALUE_AS_OBJ(constants[constant])));\
+        stack_top = qvm.stack_top;\
+    } while (false)
+
+#define AOT_CLOSE_UPVALUES(slot) qvm_close_upvalues(&slots[slot])
+
+// Back-edges return to the interpreter when the collector is waiting, so
+// the OP_LOOP there reaches its safepoint (see GC_SAFEPOINT in vm.c).
+#define AOT_LOOP(label, offset)\
+    do {\
+        if (qvm.gc_requested) {\
+            AOT_EXIT(offset);\
+        }\
+        goto label;\
+    } while (false)
+
+#define AOT_JUMP_IF_FALSE(label)\
+    do {\
+        if (! VALUE_AS_BOOL(AOT_POP())) {\
+            goto label;\
+        }\
+    } while (false)
+
+#define AOT_JUMP_IF_NOT(op, label)\
+    do {\
+        double b = VALUE_AS_NUMBER(AOT_POP());\
+        double a = VALUE_AS_NUMBER(AOT_POP());\
+        if (! (a op b)) {\
+            goto label;\
+        }\
+    } while (false)
+
+#define AOT_ABORT_IF_NIL(val)\
+    do {\
+        if (VALUE_IS_NIL(val)) {\
+            AOT_STORE();\
+            runtime_error("Null pointer object!");\
+        }\
+    } while (false)
+
+#define AOT_NEW()\
+    do {\
+        ObjClass* klass = OBJ_AS_CLASS(VALUE_AS_OBJ(AOT_POP()));\
+        AOT_STORE();\
+        ObjInstance* instance = new_instance(klass);\
+        AOT_PUSH(OBJ_VALUE(instance));\
+        AOT_PUSH(OBJ_VALUE(instance));\
+    } while (false)
+
+#define AOT_GET_PROP(pos)\
+    do {\
+        Value val = AOT_POP();\
+        AOT_ABORT_IF_NIL(val);\
+        AOT_PUSH(object_get_property(VALUE_AS_OBJ(val), pos));\
+    } while (false)
+
+#define AOT_SET_PROP(pos)\
+    do {\
+        Value val = AOT_POP();\
+        Value obj_val = AOT_PEEK(0);\
+        AOT_ABORT_IF_NIL(obj_val);\
+        object_set_property(VALUE_AS_OBJ(obj_val), pos, val);\
+    } while (false)
+
+#define AOT_BINDED_METHOD(pos)\
+    do {\
+        Value val = AOT_PEEK(0);\
+        AOT_ABORT_IF_NIL(val);\
+        Obj* instance = VALUE_AS_OBJ(val);\
+        Value method = object_get_property(instance, pos);\
+        AOT_STORE();\
+        ObjBindedMethod* binded = new_binded_method(instance, VALUE_AS_OBJ(method));\
+        stack_top--;\
+        AOT_PUSH(OBJ_VALUE(binded));\
+    } while (false)
+
+#define AOT_ARRAY(index)\
+    do {\
+        AOT_STORE();\
+        ObjArray* arr = new_array(AOT_TYPE(index));\
+        AOT_PUSH(OBJ_VALUE(arr));\
+    } while (false)
+
+#define AOT_ARRAY_PUSH()\
+    do {\
+        Value val = AOT_POP();\
+        ObjArray* arr = OBJ_AS_ARRAY(VALUE_AS_OBJ(AOT_PEEK(0)));\
+        AOT_STORE();\
+        qvm_write_barrier((Obj*) arr, val);\
+        valuearray_write(&arr->elements, val);\
+    } while (false)
+
+#define AOT_CAST(index)\
+    do {\
+        Value value = AOT_POP();\
+        AOT_STORE();\
+        AOT_PUSH(value_cast(value, AOT_TYPE(index)));\
+    } while (false)
+
+#endif
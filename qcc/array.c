@@ -53,6 +53,7 @@ static Value array_push(int argc, Value* argv) {
 #define VALUE argv[0]
 
     ObjArray* arr = OBJ_AS_ARRAY(VALUE_AS_OBJ(SELF));
+    qvm_write_barrier((Obj*) arr, VALUE);
     valuearray_write(&arr->elements, VALUE);
     return NIL_VALUE();
 
@@ -115,6 +116,7 @@ static Value array_set(int argc, Value* argv) {
         runtime_error("Array index out of limits");
         return VALUE;
     }
+    qvm_write_barrier((Obj*) arr, VALUE);
     arr->elements.values[index] = VALUE;
     return VALUE;
 
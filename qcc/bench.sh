@@ -0,0 +1,15 @@
+#!/bin/bash
+# Builds the release interpreter with each dispatch mode and times
+# the CPU-bound programs with all of them.
+# Use: ./bench.sh [make variables, for example CC=gcc]
+
+PROGRAMS="./programs/primos_bench.qz ./programs/benchmark.qz ./programs/native_bench.qz"
+TIMEFORMAT="%Us user %Ss system %Rs total"
+
+for dispatch in switch threaded; do
+    make release DISPATCH=$dispatch "$@" > /dev/null 2>&1 || exit 1
+    for program in $PROGRAMS; do
+        echo "[$dispatch] $program"
+        time ./quartz "$program" | grep "ns per call"
+    done
+done
@@ -15,10 +15,10 @@ void init_chunk(Chunk* const chunk) {
 
 void free_chunk(Chunk* const chunk) {
     if (chunk->code != NULL) {
-        FREE(uint8_t, chunk->code);
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     }
     if (chunk->lines != NULL) {
-        FREE(int, chunk->lines);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
     }
     chunk->size = 0;
     chunk->capacity = 0;
@@ -72,3 +72,210 @@ int chunk_add_type(Chunk* const chunk, Type* type) {
     return chunk->types.size - 1;
 }
 
+// Size in bytes of an instruction with its operands.
+int opcode_length(uint8_t op) {
+    switch (op) {
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CONSTANT:
+    case OP_GET_PROP:
+    case OP_SET_PROP:
+    case OP_BINDED_METHOD:
+    case OP_CLOSE_UPVALUES:
+    case OP_CAST:
+    case OP_ARRAY:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return 2;
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_CONSTANT_LONG:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LOWER:
+    case OP_JUMP_IF_NOT_LOWER_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_INVOKE:
+    case OP_GET_LOCALS:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_INCREMENT_LOCAL:
+    case OP_CLOSURE:
+        return 3;
+    case OP_CALL_DIRECT:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Values the instruction at code leaves on the stack minus the ones it
+// takes. peak gets how far above the starting height the stack goes
+// while it runs: calls push self for binded methods and invocations.
+static int opcode_stack_effect(const uint8_t* code, int* peak) {
+    int effect = 0;
+    int extra = 0;
+    switch (code[0]) {
+    case OP_ADD_NUM:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_CONCAT_STR:
+    case OP_AND:
+    case OP_OR:
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+    case OP_EQUAL_BOOL:
+    case OP_EQUAL_REF:
+    case OP_NOT_EQUAL:
+    case OP_NOT_EQUAL_NUM:
+    case OP_NOT_EQUAL_BOOL:
+    case OP_NOT_EQUAL_REF:
+    case OP_GREATER:
+    case OP_LOWER:
+    case OP_GREATER_EQUAL:
+    case OP_LOWER_EQUAL:
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_LOCAL_POP:
+    case OP_JUMP_IF_FALSE:
+    case OP_SET_PROP:
+    case OP_ARRAY_PUSH:
+    case OP_RETURN:
+        effect = -1;
+        break;
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL:
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_NEW:
+    case OP_ARRAY:
+        effect = 1;
+        break;
+    case OP_GET_LOCALS:
+    case OP_GET_LOCAL_CONSTANT:
+        effect = 2;
+        break;
+    case OP_JUMP_IF_NOT_LOWER:
+    case OP_JUMP_IF_NOT_LOWER_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        effect = -2;
+        break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        effect = -code[1];
+        extra = 1;
+        break;
+    case OP_CALL_DIRECT:
+        effect = 1 - code[3];
+        break;
+    case OP_INVOKE:
+        effect = -code[2];
+        extra = 1;
+        break;
+    default:
+        break;
+    }
+    *peak = (effect > 0 ? effect : 0) + extra;
+    return effect;
+}
+
+// Most values a frame running chunk holds at once, counting from slot 0.
+// height is the number of values at entry: slot 0 and the parameters.
+// Every path is followed, taking the highest height where paths meet.
+int chunk_max_stack(const Chunk* chunk, int height) {
+    int* heights = (int*) malloc(sizeof(int) * (chunk->size + 1));
+    int* pending = (int*) malloc(sizeof(int) * (chunk->size + 1));
+    bool* queued = (bool*) malloc(sizeof(bool) * (chunk->size + 1));
+    if (heights == NULL || pending == NULL || queued == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i <= chunk->size; i++) {
+        heights[i] = -1;
+        queued[i] = false;
+    }
+    int pending_count = 0;
+    int max = height;
+
+#define REACH(offset, h)\
+    do {\
+        int target = (offset);\
+        if (target <= chunk->size && (h) > heights[target]) {\
+            heights[target] = (h);\
+            if (! queued[target]) {\
+                queued[target] = true;\
+                pending[pending_count++] = target;\
+            }\
+        }\
+    } while (false)
+#define JUMP() ((uint16_t) ((code[1] << 8) | code[2]))
+
+    REACH(0, height);
+    while (pending_count > 0) {
+        int offset = pending[--pending_count];
+        queued[offset] = false;
+        if (offset == chunk->size) {
+            continue;
+        }
+        const uint8_t* code = &chunk->code[offset];
+        int peak;
+        int h = heights[offset];
+        int after = h + opcode_stack_effect(code, &peak);
+        if (h + peak > max) {
+            max = h + peak;
+        }
+        int next = offset + opcode_length(code[0]);
+        switch (code[0]) {
+        case OP_RETURN:
+        case OP_END:
+            break;
+        case OP_JUMP:
+            REACH(next + JUMP(), after);
+            break;
+        case OP_LOOP:
+            REACH(next - JUMP(), after);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LOWER:
+        case OP_JUMP_IF_NOT_LOWER_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            REACH(next + JUMP(), after);
+            REACH(next, after);
+            break;
+        default:
+            REACH(next, after);
+            break;
+        }
+    }
+#undef REACH
+#undef JUMP
+
+    free(heights);
+    free(pending);
+    free(queued);
+    return max;
+}
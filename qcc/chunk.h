@@ -6,20 +6,32 @@
 
 typedef enum {
     // Number operations
-    OP_ADD,
+    OP_ADD_NUM,
     OP_SUB,
     OP_MUL,
     OP_DIV,
     OP_MOD,
     OP_NEGATE,
 
+    // String operations
+    OP_CONCAT_STR,
+
     // Boolean operations
     OP_NOT,
     OP_AND,
     OP_OR,
     OP_EQUAL,
+    OP_EQUAL_NUM,
+    OP_EQUAL_BOOL,
+    OP_EQUAL_REF,
+    OP_NOT_EQUAL,
+    OP_NOT_EQUAL_NUM,
+    OP_NOT_EQUAL_BOOL,
+    OP_NOT_EQUAL_REF,
     OP_GREATER,
     OP_LOWER,
+    OP_GREATER_EQUAL,
+    OP_LOWER_EQUAL,
 
     // Reserved words and other special operations
     OP_TRUE,
@@ -31,6 +43,8 @@ typedef enum {
     // Stack operations
     OP_POP,
     OP_CALL,
+    OP_CALL_DIRECT,
+    OP_TAIL_CALL,
     OP_END,
 
     // Declarations
@@ -45,16 +59,28 @@ typedef enum {
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
 
+    // Superinstructions (see opfreq.sh)
+    OP_GET_LOCALS,
+    OP_GET_LOCAL_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_INCREMENT_LOCAL,
+
     // Upvalues
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
-    OP_BIND_UPVALUE,
-    OP_CLOSE,
-    OP_BIND_CLOSED,
+    OP_CLOSURE,
+    OP_CLOSE_UPVALUES,
 
-    // Jumps
+    // Jumps (offsets are relative to the next instruction)
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_LOOP,
+    OP_JUMP_IF_NOT_LOWER,
+    OP_JUMP_IF_NOT_LOWER_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
 
     // Objects
     OP_NEW,
@@ -87,5 +113,7 @@ int chunk_add_type(Chunk* const chunk, Type* type);
 void chunk_patch(Chunk* const chunk, int position, uint8_t bytecode);
 
 uint16_t read_long(uint8_t **pc);
+int opcode_length(uint8_t op);
+int chunk_max_stack(const Chunk* chunk, int height);
 
 #endif
@@ -3,6 +3,7 @@
 #include "typechecker.h"
 #include "values.h"
 #include "symbol.h" // to initialize and free
+#include "vm.h" // to allocate global slots
 
 #ifdef COMPILER_DEBUG
 #include "debug.h"
@@ -40,6 +41,7 @@ typedef struct {
     int function_scope_depth;
     int loop_scope_depth;
     int next_local_index;
+    int last_jump_dst;
 
     bool is_in_loop;
     Symbol* current_self;
@@ -86,8 +88,6 @@ typedef struct {
         compiler->current_self = NULL;\
     } while(false)
 
-#define NEXT_LOCAL_INDEX(compiler) (compiler->next_local_index++)
-
 #define IN_ASSIGNMENT(compiler, ...)\
     do {\
         compiler->in_assignment = true;\
@@ -121,6 +121,7 @@ static void init_inner_compiler(Compiler* const inner, Compiler* const outer, co
 
 static Chunk* current_chunk(Compiler* const compiler);
 
+static int next_local_index(Compiler* const compiler);
 static void start_scope(Compiler* const compiler);
 static void end_scope(Compiler* const compiler);
 static void pop_all_locals(Compiler* const compiler, int scope);
@@ -133,35 +134,44 @@ static int emit(Compiler* const compiler, uint8_t bytecode);
 static int emit_short(Compiler* const compiler, uint8_t bytecode, uint8_t param);
 static int emit_long(Compiler* const compiler, uint8_t bytecode, uint16_t param);
 static int emit_param(Compiler* const compiler, uint8_t op_short, uint8_t op_long,  uint16_t param);
-static void emit_bind_upvalues(Compiler* const compiler, Symbol* fn_sym, Token fn);
+static void emit_function(Compiler* const compiler, Symbol* fn_sym, ObjFunction* function);
 static bool last_emitted_byte_equals(Compiler* const compiler, uint8_t byte);
-static void emit_closed_variables(Compiler* const compiler, int depth);
-static void emit_close_stack_upvalue(Compiler* const compiler, Symbol* var_token);
+static void emit_close_upvalues(Compiler* const compiler, int depth);
 static void patch_breaks(Compiler* const compiler);
 static void patch_jump(Compiler* const compiler, int patch);
-static int emit_jump_to(Compiler* const compiler, uint8_t jump_op, uint16_t to);
+static int emit_jump(Compiler* const compiler, uint8_t jump_op);
+static void emit_loop(Compiler* const compiler, int loop_start);
+static int emit_condition_jump(Compiler* const compiler, Expr* condition);
+static int compare_jump_opcode(BinaryExpr* binary);
 static void check_jump_distance(Compiler* const compiler, int distance);
-static int get_upvalue_index_in_function(Compiler* const compiler, Symbol* var_token, Symbol* fn_ref);
-static Token symbol_to_token_identifier(Symbol* symbol);
 static void patch_chunk(Compiler* const compiler, int position, uint8_t value);
 static void patch_chunk_long(Compiler* const compiler, int position, uint16_t value);
 
 static uint16_t make_constant(Compiler* const compiler, Value value);
-static uint16_t identifier_constant(Compiler* const compiler, const Token* identifier);
 static uint8_t make_type(Compiler* const compiler, Type* type);
 
 static void update_param_index(Compiler* const compiler, Symbol* symbol);
 static void update_symbol_variable_info(Compiler* const compiler, Symbol* var_sym, uint16_t var_index);
 static uint16_t get_variable_index(Compiler* const compiler, const Token* identifier);
 static void emit_variable_declaration(Compiler* const compiler, uint16_t index);
-static void identifier_use_symbol(Compiler* const compiler, Symbol* sym, const struct IdentifierOps* ops);
 static void identifier_use(Compiler* const compiler, Token identifier, const struct IdentifierOps* ops);
 static void ensure_function_returns_value(Compiler* const compiler, Symbol* fn_sym);
 static int get_current_function_upvalue_index(Compiler* const compiler, Symbol* var);
 static Value do_compile_function(Compiler* const compiler, FunctionStmt* function, uint16_t index);
 static void preindex_class_props(Compiler* const compiler, ListStmt* body);
 static Value compile_class_var_prop(Compiler* const compiler, VarStmt* var, uint16_t index);
-static void call_with_params(Compiler* const compiler, Vector* params);
+static void call_with_params(Compiler* const compiler, Vector* params, uint8_t call_op);
+static uint8_t push_params(Compiler* const compiler, Vector* params);
+static ObjFunction* direct_callee(Compiler* const compiler, Expr* callee);
+static bool compile_tail_call(Compiler* const compiler, Expr* expr);
+static uint8_t add_opcode(Type* left, Type* right);
+static uint8_t equal_opcode(Type* left, Type* right);
+static uint8_t not_equal_opcode(Type* left, Type* right);
+static int local_slot(Compiler* const compiler, Expr* expr);
+static int identifier_local_slot(Compiler* const compiler, Token identifier);
+static int number_literal_constant(Compiler* const compiler, Expr* expr, double sign);
+static void compile_binary_operands(Compiler* const compiler, BinaryExpr* binary);
+static bool compile_local_assignment_stmt(Compiler* const compiler, AssignmentExpr* assignment);
 
 static void compile_assignment(void* ctx, AssignmentExpr* assignment);
 static void compile_identifier(void* ctx, IdentifierExpr* identifier);
@@ -294,6 +304,7 @@ static void init_compiler(Compiler* const compiler, CompilerMode mode, FileImpor
     compiler->loop_scope_depth = 0;
     compiler->is_in_loop = false;
     compiler->next_local_index = 1; // Is expected to always have GLOBAL in pos 0
+    compiler->last_jump_dst = -1;
     memset(compiler->locals, 0, UINT8_COUNT);
 
     compiler->current_self = NULL;
@@ -330,6 +341,7 @@ static void init_inner_compiler(Compiler* const inner, Compiler* const outer, co
     inner->loop_scope_depth = 0;
     inner->is_in_loop = false;
     inner->next_local_index = 1; // We expect to always have a function in pos 0
+    inner->last_jump_dst = -1;
     memset(inner->locals, 0, UINT8_COUNT);
 
     inner->current_self = outer->current_self;
@@ -367,6 +379,7 @@ CompilationResult compile(FileImport ctx, ObjFunction** const result) {
     symbol_reset_scopes(&compiler.symbols);
     ACCEPT_STMT(&compiler, ast);
     emit(&compiler, OP_END);
+    compiler.func->max_stack = chunk_max_stack(&compiler.func->chunk, 1);
 #ifdef COMPILER_DEBUG
     scoped_symbol_table_print(&compiler.symbols);
     if (!compiler.has_error) {
@@ -382,6 +395,16 @@ CompilationResult compile(FileImport ctx, ObjFunction** const result) {
 #undef END_WITH
 }
 
+// Slots are handed out in order and given back when their scope ends, so
+// the highest one used is the number of locals of the function.
+static int next_local_index(Compiler* const compiler) {
+    int index = compiler->next_local_index++;
+    if (compiler->next_local_index > compiler->func->local_count) {
+        compiler->func->local_count = compiler->next_local_index;
+    }
+    return index;
+}
+
 static void start_scope(Compiler* const compiler) {
     compiler->scope_depth++;
     compiler->locals[compiler->scope_depth] = 0;
@@ -458,13 +481,6 @@ static uint16_t make_constant(Compiler* const compiler, Value value) {
     return (uint16_t)constant_index;
 }
 
-static uint16_t identifier_constant(Compiler* const compiler, const Token* identifier) {
-    Value value = OBJ_VALUE(
-        copy_string(identifier->start, identifier->length),
-        CREATE_TYPE_STRING());
-    return make_constant(compiler, value);
-}
-
 static uint8_t make_type(Compiler* const compiler, Type* type) {
     int index = chunk_add_type(current_chunk(compiler), type);
     if (index > UINT8_COUNT) {
@@ -497,11 +513,18 @@ static void compile_block(void* ctx, BlockStmt* block) {
             return;
         }
         ACCEPT_STMT(compiler, block->stmts);
-        emit_closed_variables(compiler, 0);
+        // The OP_RETURN of the function closes the ones of its body
+        if (compiler->mode == MODE_SCRIPT || compiler->function_scope_depth > 1) {
+            emit_close_upvalues(compiler, 0);
+        }
     });
 }
 
-static void emit_closed_variables(Compiler* const compiler, int depth) {
+// Closes the upvalues of the variables captured in the current scope and
+// the depth scopes above it, before their slots are popped. Returning
+// closes the ones of the whole frame in the VM.
+static void emit_close_upvalues(Compiler* const compiler, int depth) {
+    int first_slot = -1;
     UpvalueIterator it;
     init_upvalue_iterator(&it, &compiler->symbols, depth);
     for (;;) {
@@ -509,46 +532,62 @@ static void emit_closed_variables(Compiler* const compiler, int depth) {
         if (var_sym == NULL) {
             break;
         }
-
-        emit_close_stack_upvalue(compiler, var_sym);
-        SYMBOL_SET_FOREACH(var_sym->upvalue_fn_refs, {
-            int index = get_upvalue_index_in_function(compiler, var_sym, elements[i]);
-            identifier_use_symbol(compiler, elements[i], &ops_get_identifier);
-            emit(compiler, OP_BIND_CLOSED);
-            emit(compiler, index);
-        });
-        emit(compiler, OP_POP);
+        if (var_sym->global) {
+            continue;
+        }
+        if (first_slot == -1 || var_sym->constant_index < first_slot) {
+            first_slot = var_sym->constant_index;
+        }
+    }
+    if (first_slot != -1) {
+        emit_short(compiler, OP_CLOSE_UPVALUES, first_slot);
     }
-}
-
-static void emit_close_stack_upvalue(Compiler* const compiler, Symbol* var_sym) {
-    identifier_use_symbol(compiler, var_sym, &ops_get_identifier);
-    emit(compiler, OP_CLOSE);
-}
-
-static int get_upvalue_index_in_function(Compiler* const compiler, Symbol* var_name, Symbol* fn_ref) {
-    assert(fn_ref != NULL);
-    assert(fn_ref->kind == SYMBOL_FUNCTION);
-    assert(var_name != NULL);
-    return symbol_get_function_upvalue_index(fn_ref, var_name);
-}
-
-static Token symbol_to_token_identifier(Symbol* symbol) {
-    return (Token){
-        .kind = TOKEN_IDENTIFIER,
-        .start = SYMBOL_NAME_START(symbol->name),
-        .length = SYMBOL_NAME_LENGTH(symbol->name),
-        .line = symbol->line,
-        .column = symbol->column,
-    };
 }
 
 static void compile_expr(void* ctx, ExprStmt* expr) {
     Compiler* compiler = (Compiler*)ctx;
+    if (EXPR_IS_ASSIGNMENT(*expr->inner)) {
+        if (compile_local_assignment_stmt(compiler, &expr->inner->assignment)) {
+            return;
+        }
+    }
     ACCEPT_EXPR(compiler, expr->inner);
     emit(compiler, OP_POP);
 }
 
+// An assignment to a local used as statement does not need to leave its value
+// in the stack. 'x = x + n' and 'x = x - n' with a number literal n are
+// emitted as OP_INCREMENT_LOCAL, any other value as OP_SET_LOCAL_POP.
+// Returns false if the variable is not a local of the current function.
+static bool compile_local_assignment_stmt(Compiler* const compiler, AssignmentExpr* assignment) {
+    int slot = identifier_local_slot(compiler, assignment->name);
+    if (slot == -1) {
+        return false;
+    }
+
+    Expr* value = assignment->value;
+    if (EXPR_IS_BINARY(*value)) {
+        BinaryExpr* binary = &value->binary;
+        bool is_increment = binary->op.kind == TOKEN_PLUS || binary->op.kind == TOKEN_MINUS;
+        if (is_increment && TYPE_IS_NUMBER(binary->left_type) && local_slot(compiler, binary->left) == slot) {
+            double sign = (binary->op.kind == TOKEN_MINUS) ? -1 : 1;
+            int constant = number_literal_constant(compiler, binary->right, sign);
+            if (constant != -1) {
+                compiler->last_line = binary->op.line;
+                emit_short(compiler, OP_INCREMENT_LOCAL, slot);
+                emit(compiler, constant);
+                return true;
+            }
+        }
+    }
+
+    IN_ASSIGNMENT(compiler, {
+        ACCEPT_EXPR(compiler, value);
+    });
+    emit_short(compiler, OP_SET_LOCAL_POP, slot);
+    return true;
+}
+
 static void compile_function(void* ctx, FunctionStmt* function) {
     Compiler* compiler = (Compiler*) ctx;
     uint16_t fn_index = get_variable_index(compiler, &function->identifier);
@@ -557,12 +596,9 @@ static void compile_function(void* ctx, FunctionStmt* function) {
     assert(symbol != NULL);
 
     Value fn_value = do_compile_function(compiler, function, fn_index);
-    uint16_t default_value = make_constant(compiler, fn_value);
-    emit_param(compiler, OP_CONSTANT, OP_CONSTANT_LONG, default_value);
+    emit_function(compiler, symbol, OBJ_AS_FUNCTION(VALUE_AS_OBJ(fn_value)));
 
     emit_variable_declaration(compiler, fn_index);
-
-    emit_bind_upvalues(compiler, symbol, function->identifier);
 }
 
 static Value do_compile_function(Compiler* const compiler, FunctionStmt* function, uint16_t index) {
@@ -572,17 +608,20 @@ static Value do_compile_function(Compiler* const compiler, FunctionStmt* functio
 
     Compiler inner;
     init_inner_compiler(&inner, compiler, &function->identifier, symbol);
+    symbol->function.compiled = (Obj*) inner.func;
     start_scope(&inner);
     update_param_index(&inner, symbol);
+    int entry_height = inner.next_local_index;
     ACCEPT_STMT(&inner, function->body);
     ensure_function_returns_value(&inner, symbol);
     end_scope(&inner);
+    inner.func->max_stack = chunk_max_stack(current_chunk(&inner), entry_height);
 
     if (inner.has_error) {
         compiler->has_error = true;
     }
 
-    return OBJ_VALUE(inner.func, symbol->type);
+    return OBJ_VALUE(inner.func);
 }
 
 static void compile_native(void* ctx, NativeFunctionStmt* native) {
@@ -607,7 +646,7 @@ static void compile_native(void* ctx, NativeFunctionStmt* native) {
         native->function,
         symbol->type);
 
-    uint16_t default_value = make_constant(compiler, OBJ_VALUE(obj, symbol->type));
+    uint16_t default_value = make_constant(compiler, OBJ_VALUE(obj));
     emit_param(compiler, OP_CONSTANT, OP_CONSTANT_LONG, default_value);
     emit_variable_declaration(compiler, native_index);
 }
@@ -660,7 +699,7 @@ static void compile_class(void* ctx, ClassStmt* klass) {
         error(compiler, "Too much properties for a single class");
     }
 
-    uint16_t default_value = make_constant(compiler, OBJ_VALUE(obj, symbol->type));
+    uint16_t default_value = make_constant(compiler, OBJ_VALUE(obj));
     emit_param(compiler, OP_CONSTANT, OP_CONSTANT_LONG, default_value);
     emit_variable_declaration(compiler, klass_index);
 }
@@ -727,21 +766,27 @@ static void compile_native(void* ctx, NativeFunctionStmt* native) {
         native->function,
         symbol->type);
 
-    uint16_t default_value = make_constant(compiler, OBJ_VALUE(obj, symbol->type));
+    uint16_t default_value = make_constant(compiler, OBJ_VALUE(obj));
     emit_param(compiler, OP_CONSTANT, OP_CONSTANT_LONG, default_value);
     emit_variable_declaration(compiler, native_index);
 }
 
-static void emit_bind_upvalues(Compiler* const compiler, Symbol* fn_sym, Token fn) {
+// Functions without upvalues are plain constants. The others are wrapped
+// in a new closure each time, which takes every upvalue from a local of
+// the current function or from one of its own upvalues.
+static void emit_function(Compiler* const compiler, Symbol* fn_sym, ObjFunction* function) {
+    uint16_t constant = make_constant(compiler, OBJ_VALUE(function));
+    if (function->upvalue_count == 0) {
+        emit_param(compiler, OP_CONSTANT, OP_CONSTANT_LONG, constant);
+        return;
+    }
     Symbol** upvalues = SYMBOL_SET_GET_ELEMENTS(fn_sym->function.upvalues);
-    int size = SYMBOL_SET_SIZE(fn_sym->function.upvalues);
-    for (int i = 0; i < size; i++) {
-        Symbol* upvalue_sym = upvalues[i];
-        identifier_use(compiler, fn, &ops_get_identifier);
-        emit(compiler, OP_BIND_UPVALUE);
-        emit(compiler, upvalue_sym->constant_index);
-        emit(compiler, i);
+    for (int i = 0; i < function->upvalue_count; i++) {
+        int index = get_current_function_upvalue_index(compiler, upvalues[i]);
+        function->upvalues[i].is_local = (index == -1);
+        function->upvalues[i].index = (index == -1) ? upvalues[i]->constant_index : index;
     }
+    emit_long(compiler, OP_CLOSURE, constant);
 }
 
 static void patch_chunk(Compiler* const compiler, int position, uint8_t value) {
@@ -756,7 +801,8 @@ static void patch_chunk_long(Compiler* const compiler, int position, uint16_t va
 }
 
 static void ensure_function_returns_value(Compiler* const compiler, Symbol* fn_sym) {
-    if (last_emitted_byte_equals(compiler, OP_RETURN)) {
+    bool jump_to_end = compiler->last_jump_dst == current_chunk(compiler)->size;
+    if (last_emitted_byte_equals(compiler, OP_RETURN) && !jump_to_end) {
         return;
     }
     if (TYPE_IS_VOID(TYPE_FN_RETURN(fn_sym->type))) {
@@ -770,19 +816,22 @@ static void update_param_index(Compiler* const compiler, Symbol* symbol) {
     for (uint32_t i = 0; i < symbol->function.param_names.size; i++) {
         Token param = param_names[i];
         Symbol* param_sym = lookup_str(compiler, param.start, param.length);
-        param_sym->constant_index = NEXT_LOCAL_INDEX(compiler);
+        param_sym->constant_index = next_local_index(compiler);
     }
     if (HAVE_SELF(compiler)) {
         Symbol* self = lookup_str(compiler, CLASS_SELF_NAME, CLASS_SELF_LENGTH);
         assert(self != NULL);
-        self->constant_index = NEXT_LOCAL_INDEX(compiler);
+        self->constant_index = next_local_index(compiler);
     }
 }
 
 static void compile_return(void* ctx, ReturnStmt* return_) {
     Compiler* compiler = (Compiler*) ctx;
 
-    emit_closed_variables(compiler, compiler->function_scope_depth);
+    if (return_->inner != NULL && compile_tail_call(compiler, return_->inner)) {
+        emit(compiler, OP_RETURN);
+        return;
+    }
 
     if (return_->inner != NULL) {
         IN_ASSIGNMENT(compiler, { // We assume a return is also an assigment
@@ -794,17 +843,32 @@ static void compile_return(void* ctx, ReturnStmt* return_) {
     emit(compiler, OP_RETURN);
 }
 
+// A call in tail position reuses the current frame, once the VM closed its
+// upvalues. The OP_RETURN after the OP_TAIL_CALL is used when the callee is
+// not a function nor a closure.
+static bool compile_tail_call(Compiler* const compiler, Expr* expr) {
+    if (! EXPR_IS_CALL(*expr)) {
+        return false;
+    }
+    CallExpr* call = &expr->call;
+    IN_ASSIGNMENT(compiler, {
+        WANT_TO_CALL(compiler, {
+            ACCEPT_EXPR(compiler, call->callee);
+            call_with_params(compiler, &call->params, OP_TAIL_CALL);
+        });
+    });
+    return true;
+}
+
 static void compile_if(void* ctx, IfStmt* if_) {
     Compiler* compiler = (Compiler*) ctx;
     bool have_else = if_->else_ != NULL;
     int patch_else_pos = 0;
 
-    ACCEPT_EXPR(ctx, if_->condition);
-
-    int patch_if_pos = emit_jump_to(compiler, OP_JUMP_IF_FALSE, 0);
+    int patch_if_pos = emit_condition_jump(compiler, if_->condition);
     ACCEPT_STMT(ctx, if_->then);
     if (have_else) {
-        patch_else_pos = emit_jump_to(compiler, OP_JUMP, 0);
+        patch_else_pos = emit_jump(compiler, OP_JUMP);
     }
     patch_jump(compiler, patch_if_pos);
 
@@ -822,23 +886,23 @@ static void compile_for(void* ctx, ForStmt* for_) {
 
         ACCEPT_STMT(compiler, for_->init);
 
-        int loop_init = emit(compiler, OP_NOP);
+        int loop_init = current_chunk(compiler)->size;
 
+        int patch_for_pos = -1; // Without condition there is nothing to patch
         if (for_->condition != NULL) {
-            ACCEPT_EXPR(compiler, for_->condition);
-        } else {
-            emit(compiler, OP_TRUE);
+            patch_for_pos = emit_condition_jump(compiler, for_->condition);
         }
-        int patch_for_pos = emit_jump_to(compiler, OP_JUMP_IF_FALSE, 0);
 
         CONTINUE_CTX(compiler, loop_init, {
             ACCEPT_STMT(compiler, for_->body);
         });
         ACCEPT_STMT(compiler, for_->mod);
 
-        emit_jump_to(compiler, OP_JUMP, loop_init);
+        emit_loop(compiler, loop_init);
 
-        patch_jump(compiler, patch_for_pos);
+        if (patch_for_pos != -1) {
+            patch_jump(compiler, patch_for_pos);
+        }
         patch_breaks(compiler);
 
         end_scope(compiler);
@@ -850,16 +914,15 @@ static void compile_while(void* ctx, WhileStmt* while_) {
     LOOP(compiler, {
         BREAK_CTX_PUSH_LOOP(compiler);
 
-        int loop_init = emit(compiler, OP_NOP);
+        int loop_init = current_chunk(compiler)->size;
 
-        ACCEPT_EXPR(compiler, while_->condition);
-        int patch_for_pos = emit_jump_to(compiler, OP_JUMP_IF_FALSE, 0);
+        int patch_for_pos = emit_condition_jump(compiler, while_->condition);
 
         CONTINUE_CTX(compiler, loop_init, {
             ACCEPT_STMT(compiler, while_->body);
         });
 
-        emit_jump_to(compiler, OP_JUMP, loop_init);
+        emit_loop(compiler, loop_init);
 
         patch_jump(compiler, patch_for_pos);
         patch_breaks(compiler);
@@ -868,13 +931,16 @@ static void compile_while(void* ctx, WhileStmt* while_) {
 
 static void compile_loopg(void* ctx, LoopGotoStmt* loopg) {
     Compiler* compiler = (Compiler*) ctx;
+    if (compiler->loop_scope_depth > 0) {
+        emit_close_upvalues(compiler, compiler->loop_scope_depth - 1);
+    }
     reset_loop_locals(compiler);
     if (loopg->kind == LOOP_BREAK) {
-        int break_pos = emit_jump_to(compiler, OP_JUMP, 0);
+        int break_pos = emit_jump(compiler, OP_JUMP);
         BREAK_CTX_PUSH_BREAK(compiler, break_pos);
     } else {
         assert(compiler->continue_ctx != CONTINUE_CTX_NOT_DEFINED);
-        emit_jump_to(compiler, OP_JUMP, compiler->continue_ctx);
+        emit_loop(compiler, compiler->continue_ctx);
     }
 }
 
@@ -891,28 +957,65 @@ static void patch_breaks(Compiler* const compiler) {
     if (breaks_in_loop <= 0) {
         return;
     }
-    int jump_dst = emit(compiler, OP_NOP);
     for (int i = 0; i < breaks_in_loop; i++) {
         int break_to_patch = BREAK_CTX_POP_BREAK(compiler);
-        check_jump_distance(compiler, jump_dst - break_to_patch);
-        patch_chunk_long(compiler, break_to_patch, jump_dst);
+        patch_jump(compiler, break_to_patch);
     }
 }
 
+// Jump offsets are counted from the instruction after the jump, whose
+// last byte is in the patch position.
 static void patch_jump(Compiler* const compiler, int patch) {
-    int jump_dst = emit(compiler, OP_NOP);
-    check_jump_distance(compiler, jump_dst - patch);
-    patch_chunk_long(compiler, patch, jump_dst);
+    int jump_dst = current_chunk(compiler)->size;
+    int offset = jump_dst - (patch + 1);
+    check_jump_distance(compiler, offset);
+    patch_chunk_long(compiler, patch, offset);
+    compiler->last_jump_dst = jump_dst;
+}
+
+static int emit_jump(Compiler* const compiler, uint8_t jump_op) {
+    return emit_long(compiler, jump_op, UINT16_MAX); // Patched later
+}
+
+static void emit_loop(Compiler* const compiler, int loop_start) {
+    int offset = current_chunk(compiler)->size + 3 - loop_start; // 3: OP_LOOP and offset
+    check_jump_distance(compiler, offset);
+    emit_long(compiler, OP_LOOP, offset);
+}
+
+// Emits the jump taken when the condition is false. Comparisons between
+// numbers jump directly, without pushing and popping a Bool.
+static int emit_condition_jump(Compiler* const compiler, Expr* condition) {
+    if (EXPR_IS_BINARY(*condition)) {
+        BinaryExpr* binary = &condition->binary;
+        int jump_op = compare_jump_opcode(binary);
+        if (jump_op != -1) {
+            compiler->last_line = binary->op.line;
+            compile_binary_operands(compiler, binary);
+            return emit_jump(compiler, jump_op);
+        }
+    }
+    ACCEPT_EXPR(compiler, condition);
+    return emit_jump(compiler, OP_JUMP_IF_FALSE);
 }
 
-static int emit_jump_to(Compiler* const compiler, uint8_t jump_op, uint16_t to) {
-    int jump_to_init = emit_long(compiler, jump_op, to);
-    check_jump_distance(compiler, jump_to_init - (int)to);
-    return jump_to_init;
+static int compare_jump_opcode(BinaryExpr* binary) {
+    if (! TYPE_IS_NUMBER(binary->left_type) || ! TYPE_IS_NUMBER(binary->right_type)) {
+        return -1;
+    }
+    switch (binary->op.kind) {
+    case TOKEN_LOWER: return OP_JUMP_IF_NOT_LOWER;
+    case TOKEN_LOWER_EQUAL: return OP_JUMP_IF_NOT_LOWER_EQUAL;
+    case TOKEN_GREATER: return OP_JUMP_IF_NOT_GREATER;
+    case TOKEN_GREATER_EQUAL: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    case TOKEN_EQUAL_EQUAL: return OP_JUMP_IF_NOT_EQUAL;
+    case TOKEN_BANG_EQUAL: return OP_JUMP_IF_EQUAL;
+    default: return -1;
+    }
 }
 
 static void check_jump_distance(Compiler* const compiler, int distance) {
-    assert(distance > 0);
+    assert(distance >= 0);
     if (distance > UINT16_MAX) {
         error(compiler, "Jump too large");
     }
@@ -943,9 +1046,14 @@ static void update_symbol_variable_info(Compiler* const compiler, Symbol* var_sy
 
 static uint16_t get_variable_index(Compiler* const compiler, const Token* identifier) {
     if (compiler->scope_depth == 0) {
-        return identifier_constant(compiler, identifier);
+        int slot = qvm_new_global();
+        if (slot > UINT16_MAX) {
+            error(compiler, "Too many globals!");
+            return 0;
+        }
+        return (uint16_t) slot;
     }
-    uint16_t index = NEXT_LOCAL_INDEX(compiler);
+    uint16_t index = next_local_index(compiler);
     compiler->locals[compiler->scope_depth]++;
     return index;
 }
@@ -958,6 +1066,7 @@ static void emit_variable_declaration(Compiler* const compiler, uint16_t index)
 
 static void compile_identifier(void* ctx, IdentifierExpr* identifier) {
     Compiler* compiler = (Compiler*) ctx;
+    compiler->last_line = identifier->name.line;
     identifier_use(compiler, identifier->name, &ops_get_identifier);
 }
 
@@ -969,11 +1078,6 @@ static void compile_assignment(void* ctx, AssignmentExpr* assignment) {
     identifier_use(compiler, assignment->name, &ops_set_identifier);
 }
 
-static void identifier_use_symbol(Compiler* const compiler, Symbol* sym, const struct IdentifierOps* ops) {
-    Token var_token = symbol_to_token_identifier(sym);
-    identifier_use(compiler, var_token, ops);
-}
-
 static void identifier_use(Compiler* const compiler, Token identifier, const struct IdentifierOps* ops) {
     Symbol* symbol = lookup_str(compiler, identifier.start, identifier.length);
     assert(symbol != NULL);
@@ -1032,7 +1136,7 @@ static void compile_literal(void* ctx, LiteralExpr* literal) {
     }
     case TOKEN_STRING: {
         ObjString* str = copy_string(literal->literal.start, literal->literal.length);
-        value = OBJ_VALUE(str, CREATE_TYPE_STRING());
+        value = OBJ_VALUE(str);
         break;
     }
     default:
@@ -1047,26 +1151,25 @@ static void compile_binary(void* ctx, BinaryExpr* binary) {
     Compiler* compiler = (Compiler*) ctx;
     compiler->last_line = binary->op.line;
 
-    ACCEPT_EXPR(compiler, binary->left);
-    ACCEPT_EXPR(compiler, binary->right);
+    compile_binary_operands(compiler, binary);
 
 #define EMIT(byte) emit(compiler, byte)
 #define EMIT_SHORT(first, second) emit_short(compiler, first, second)
 
     switch(binary->op.kind) {
-    case TOKEN_PLUS: EMIT(OP_ADD); break;
+    case TOKEN_PLUS: EMIT(add_opcode(binary->left_type, binary->right_type)); break;
     case TOKEN_MINUS: EMIT(OP_SUB); break;
     case TOKEN_STAR: EMIT(OP_MUL); break;
     case TOKEN_SLASH: EMIT(OP_DIV); break;
     case TOKEN_AND: EMIT(OP_AND); break;
     case TOKEN_OR: EMIT(OP_OR); break;
     case TOKEN_PERCENT: EMIT(OP_MOD); break;
-    case TOKEN_EQUAL_EQUAL: EMIT(OP_EQUAL); break;
-    case TOKEN_BANG_EQUAL: EMIT_SHORT(OP_EQUAL, OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL: EMIT(equal_opcode(binary->left_type, binary->right_type)); break;
+    case TOKEN_BANG_EQUAL: EMIT(not_equal_opcode(binary->left_type, binary->right_type)); break;
     case TOKEN_LOWER: EMIT(OP_LOWER); break;
-    case TOKEN_LOWER_EQUAL: EMIT_SHORT(OP_GREATER, OP_NOT); break;
+    case TOKEN_LOWER_EQUAL: EMIT(OP_LOWER_EQUAL); break;
     case TOKEN_GREATER: EMIT(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: EMIT_SHORT(OP_LOWER, OP_NOT); break;
+    case TOKEN_GREATER_EQUAL: EMIT(OP_GREATER_EQUAL); break;
     default:
         error(compiler, "Unkown binary operator in expression");
         return;
@@ -1076,6 +1179,117 @@ static void compile_binary(void* ctx, BinaryExpr* binary) {
 #undef EMIT_BYTES
 }
 
+// The typechecker only allows '+' between two Numbers or two Strings.
+static uint8_t add_opcode(Type* left, Type* right) {
+    assert(left != NULL && right != NULL);
+    left = RESOLVE_IF_TYPEALIAS(left);
+    right = RESOLVE_IF_TYPEALIAS(right);
+    if (TYPE_IS_STRING(left) && TYPE_IS_STRING(right)) {
+        return OP_CONCAT_STR;
+    }
+    return OP_ADD_NUM;
+}
+
+static bool type_is_reference(Type* type) {
+    switch (type->kind) {
+    case TYPE_STRING:
+    case TYPE_OBJECT:
+    case TYPE_ARRAY:
+    case TYPE_FUNCTION:
+    case TYPE_CLASS:
+    case TYPE_NIL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Any typed values can hold anything at runtime, so only
+// the generic OP_EQUAL is safe for them.
+static uint8_t equal_opcode(Type* left, Type* right) {
+    assert(left != NULL && right != NULL);
+    left = RESOLVE_IF_TYPEALIAS(left);
+    right = RESOLVE_IF_TYPEALIAS(right);
+    if (TYPE_IS_NUMBER(left) && TYPE_IS_NUMBER(right)) {
+        return OP_EQUAL_NUM;
+    }
+    if (TYPE_IS_BOOL(left) && TYPE_IS_BOOL(right)) {
+        return OP_EQUAL_BOOL;
+    }
+    if (type_is_reference(left) && type_is_reference(right)) {
+        return OP_EQUAL_REF;
+    }
+    return OP_EQUAL;
+}
+
+static uint8_t not_equal_opcode(Type* left, Type* right) {
+    switch (equal_opcode(left, right)) {
+    case OP_EQUAL_NUM: return OP_NOT_EQUAL_NUM;
+    case OP_EQUAL_BOOL: return OP_NOT_EQUAL_BOOL;
+    case OP_EQUAL_REF: return OP_NOT_EQUAL_REF;
+    default: return OP_NOT_EQUAL;
+    }
+}
+
+// Pushing a local followed by another local or a constant are the most
+// frequent opcode pairs (see opfreq.sh), so both operands are pushed by a
+// single superinstruction when possible.
+static void compile_binary_operands(Compiler* const compiler, BinaryExpr* binary) {
+    int left_slot = local_slot(compiler, binary->left);
+    if (left_slot != -1) {
+        int right_slot = local_slot(compiler, binary->right);
+        if (right_slot != -1) {
+            emit_short(compiler, OP_GET_LOCALS, left_slot);
+            emit(compiler, right_slot);
+            return;
+        }
+        int constant = number_literal_constant(compiler, binary->right, 1);
+        if (constant != -1) {
+            emit_short(compiler, OP_GET_LOCAL_CONSTANT, left_slot);
+            emit(compiler, constant);
+            return;
+        }
+    }
+    ACCEPT_EXPR(compiler, binary->left);
+    ACCEPT_EXPR(compiler, binary->right);
+}
+
+// Returns the stack slot if the expression is a local variable of the
+// current function (not an upvalue nor a global), or -1.
+static int local_slot(Compiler* const compiler, Expr* expr) {
+    if (! EXPR_IS_IDENTIFIER(*expr)) {
+        return -1;
+    }
+    return identifier_local_slot(compiler, expr->identifier.name);
+}
+
+static int identifier_local_slot(Compiler* const compiler, Token identifier) {
+    Symbol* symbol = lookup_str(compiler, identifier.start, identifier.length);
+    assert(symbol != NULL);
+    if (symbol->global) {
+        return -1;
+    }
+    if (get_current_function_upvalue_index(compiler, symbol) != -1) {
+        return -1;
+    }
+    assert(symbol->constant_index < UINT8_MAX);
+    return symbol->constant_index;
+}
+
+// Adds a number literal (multiplied by sign) to the constants and returns its
+// index, or -1 if the expression is not a number literal or the index does
+// not fit in a byte.
+static int number_literal_constant(Compiler* const compiler, Expr* expr, double sign) {
+    if (! EXPR_IS_LITERAL(*expr) || expr->literal.literal.kind != TOKEN_NUMBER) {
+        return -1;
+    }
+    if (current_chunk(compiler)->constants.size > UINT8_MAX) {
+        return -1;
+    }
+    double d = (double) strtod(expr->literal.literal.start, NULL);
+    return make_constant(compiler, NUMBER_VALUE(sign * d));
+}
+
 static void compile_unary(void* ctx, UnaryExpr* unary) {
     Compiler* compiler = (Compiler*) ctx;
     compiler->last_line = unary->op.line;
@@ -1101,9 +1315,18 @@ static void compile_unary(void* ctx, UnaryExpr* unary) {
 
 static void compile_call(void* ctx, CallExpr* call) {
     Compiler* compiler = (Compiler*) ctx;
+    ObjFunction* direct = direct_callee(compiler, call->callee);
+    if (direct != NULL) {
+        uint16_t constant = make_constant(compiler, OBJ_VALUE(direct));
+        uint8_t param_count = push_params(compiler, &call->params);
+        compiler->last_line = call->callee->identifier.name.line;
+        emit_long(compiler, OP_CALL_DIRECT, constant);
+        emit(compiler, param_count);
+        return;
+    }
     WANT_TO_CALL(compiler, {
         ACCEPT_EXPR(compiler, call->callee);
-        call_with_params(compiler, &call->params);
+        call_with_params(compiler, &call->params, OP_CALL);
     });
 }
 
@@ -1197,12 +1420,43 @@ static void compile_new(void* ctx, NewExpr* new_) {
 
     WANT_TO_CALL(compiler, {
         compiler->prop_index = init_prop->constant_index;
-        call_with_params(compiler, &new_->params);
+        call_with_params(compiler, &new_->params, OP_CALL);
     });
     emit(compiler, OP_POP); // The result of calling init is always nil.
 }
 
-static void call_with_params(Compiler* const compiler, Vector* params) {
+// A call to the name of a function declaration always reaches the same
+// function, unless the name is assigned somewhere or the function needs a
+// closure. Those calls are emitted as OP_CALL_DIRECT, which does not push
+// the callee. Returns the function or NULL.
+static ObjFunction* direct_callee(Compiler* const compiler, Expr* callee) {
+    if (! EXPR_IS_IDENTIFIER(*callee)) {
+        return NULL;
+    }
+    Token name = callee->identifier.name;
+    Symbol* symbol = lookup_str(compiler, name.start, name.length);
+    assert(symbol != NULL);
+    if (symbol->kind != SYMBOL_FUNCTION || symbol->function.compiled == NULL || symbol->function.reassigned) {
+        return NULL;
+    }
+    ObjFunction* function = OBJ_AS_FUNCTION(symbol->function.compiled);
+    if (function->upvalue_count > 0) {
+        return NULL;
+    }
+    return function;
+}
+
+static void call_with_params(Compiler* const compiler, Vector* params, uint8_t call_op) {
+    uint8_t param_count = push_params(compiler, params);
+    if (compiler->prop_index != PROP_INDEX_NOT_DEFINED) {
+        emit_short(compiler, OP_INVOKE, compiler->prop_index);
+        emit(compiler, param_count);
+    } else {
+        emit_short(compiler, call_op, param_count);
+    }
+}
+
+static uint8_t push_params(Compiler* const compiler, Vector* params) {
     Expr** exprs = VECTOR_AS_EXPRS(params);
 
     // Disable want_to_call while processing params. If you dont disable it and
@@ -1229,12 +1483,6 @@ static void call_with_params(Compiler* const compiler, Vector* params) {
     if (i > UINT8_MAX) {
         error(compiler, "Parameter count exceeds the max number of parameters: 254");
     }
-
-    if (compiler->prop_index != PROP_INDEX_NOT_DEFINED) {
-        emit_short(compiler, OP_INVOKE, compiler->prop_index);
-        emit(compiler, i);
-    } else {
-        emit_short(compiler, OP_CALL, i);
-    }
+    return (uint8_t) i;
 }
 
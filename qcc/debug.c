@@ -96,19 +96,30 @@ void valuearray_print(const ValueArray* values) {
 }
 
 static const char* OpCodeStrings[] = {
-    "OP_ADD",
+    "OP_ADD_NUM",
     "OP_SUB",
     "OP_MUL",
     "OP_DIV",
     "OP_MOD",
     "OP_NEGATE",
 
+    "OP_CONCAT_STR",
+
     "OP_NOT",
     "OP_AND",
     "OP_OR",
     "OP_EQUAL",
+    "OP_EQUAL_NUM",
+    "OP_EQUAL_BOOL",
+    "OP_EQUAL_REF",
+    "OP_NOT_EQUAL",
+    "OP_NOT_EQUAL_NUM",
+    "OP_NOT_EQUAL_BOOL",
+    "OP_NOT_EQUAL_REF",
     "OP_GREATER",
     "OP_LOWER",
+    "OP_GREATER_EQUAL",
+    "OP_LOWER_EQUAL",
 
     "OP_TRUE",
     "OP_FALSE",
@@ -118,6 +129,8 @@ static const char* OpCodeStrings[] = {
 
     "OP_POP",
     "OP_CALL",
+    "OP_CALL_DIRECT",
+    "OP_TAIL_CALL",
     "OP_END",
 
     "OP_CONSTANT",
@@ -131,14 +144,25 @@ static const char* OpCodeStrings[] = {
     "OP_GET_LOCAL",
     "OP_SET_LOCAL",
 
+    "OP_GET_LOCALS",
+    "OP_GET_LOCAL_CONSTANT",
+    "OP_SET_LOCAL_POP",
+    "OP_INCREMENT_LOCAL",
+
     "OP_GET_UPVALUE",
     "OP_SET_UPVALUE",
-    "OP_BIND_UPVALUE",
-    "OP_CLOSE",
-    "OP_BIND_CLOSED",
+    "OP_CLOSURE",
+    "OP_CLOSE_UPVALUES",
 
     "OP_JUMP",
     "OP_JUMP_IF_FALSE",
+    "OP_LOOP",
+    "OP_JUMP_IF_NOT_LOWER",
+    "OP_JUMP_IF_NOT_LOWER_EQUAL",
+    "OP_JUMP_IF_NOT_GREATER",
+    "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    "OP_JUMP_IF_NOT_EQUAL",
+    "OP_JUMP_IF_EQUAL",
 
     "OP_NEW",
     "OP_INVOKE",
@@ -155,6 +179,10 @@ void opcode_print(uint8_t op) {
     printf("%s\n", OpCodeStrings[op]);
 }
 
+const char* opcode_name(uint8_t op) {
+    return OpCodeStrings[op];
+}
+
 void stack_print(const Value* stack_top, Value* stack) {
     Value* current = stack;
     while (current < stack_top) {
@@ -173,6 +201,10 @@ static int chunk_long_print(const Chunk* chunk, int i);
 static void standalone_chunk_print(const Chunk* chunk);
 static void chunk_print_value(Value value);
 
+// Functions dumped by the running chunk_print. A function called with
+// OP_CALL_DIRECT is a constant of its callers, even of itself.
+static Vector dumped_functions; // Vector<ObjFunction*>
+
 static void chunk_format_print(const Chunk* chunk, int i, const char* format, ...) {
     printf("[%02d;%02d]\t", i, chunk->lines[i]);
     va_list params;
@@ -223,7 +255,7 @@ static void standalone_chunk_print(const Chunk* chunk) {
     int i = 0;
     while (i < chunk->size) {
         switch(chunk->code[i]) {
-        case OP_ADD:
+        case OP_ADD_NUM:
         case OP_SUB:
         case OP_MUL:
         case OP_DIV:
@@ -238,10 +270,19 @@ static void standalone_chunk_print(const Chunk* chunk) {
         case OP_FALSE:
         case OP_NIL:
         case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_EQUAL_BOOL:
+        case OP_EQUAL_REF:
+        case OP_NOT_EQUAL:
+        case OP_NOT_EQUAL_NUM:
+        case OP_NOT_EQUAL_BOOL:
+        case OP_NOT_EQUAL_REF:
+        case OP_GREATER_EQUAL:
+        case OP_LOWER_EQUAL:
+        case OP_CONCAT_STR:
         case OP_LOWER:
         case OP_POP:
         case OP_GREATER:
-        case OP_CLOSE:
         case OP_NEW:
         case OP_END: {
             i = chunk_opcode_print(chunk, i);
@@ -252,15 +293,17 @@ static void standalone_chunk_print(const Chunk* chunk) {
         case OP_SET_GLOBAL:
         case OP_GET_LOCAL:
         case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
         case OP_GET_UPVALUE:
         case OP_SET_UPVALUE:
         case OP_CONSTANT:
         case OP_GET_PROP:
         case OP_SET_PROP:
         case OP_BINDED_METHOD:
-        case OP_BIND_CLOSED:
+        case OP_CLOSE_UPVALUES:
         case OP_CAST:
-        case OP_CALL: {
+        case OP_CALL:
+        case OP_TAIL_CALL: {
             i = chunk_opcode_print(chunk, i);
             i = chunk_short_print(chunk, i);
             break;
@@ -269,16 +312,32 @@ static void standalone_chunk_print(const Chunk* chunk) {
         case OP_SET_GLOBAL_LONG:
         case OP_DEFINE_GLOBAL_LONG:
         case OP_CONSTANT_LONG:
+        case OP_CLOSURE:
         case OP_ARRAY:
         case OP_ARRAY_PUSH:
         case OP_JUMP:
-        case OP_JUMP_IF_FALSE: {
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_NOT_LOWER:
+        case OP_JUMP_IF_NOT_LOWER_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL: {
+            i = chunk_opcode_print(chunk, i);
+            i = chunk_long_print(chunk, i);
+            break;
+        }
+        case OP_CALL_DIRECT: {
             i = chunk_opcode_print(chunk, i);
             i = chunk_long_print(chunk, i);
+            i = chunk_short_print(chunk, i);
             break;
         }
         case OP_INVOKE:
-        case OP_BIND_UPVALUE: {
+        case OP_GET_LOCALS:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_INCREMENT_LOCAL: {
             i = chunk_opcode_print(chunk, i);
             i = chunk_short_print(chunk, i);
             i = chunk_short_print(chunk, i);
@@ -308,13 +367,23 @@ static void chunk_print_value(Value value) {
     }
     if (OBJ_IS_FUNCTION(obj)) {
         ObjFunction* fn = OBJ_AS_FUNCTION(obj);
+        ObjFunction** dumped = VECTOR_AS(&dumped_functions, ObjFunction*);
+        for (uint32_t i = 0; i < dumped_functions.size; i++) {
+            if (dumped[i] == fn) {
+                return;
+            }
+        }
+        VECTOR_ADD(&dumped_functions, fn, ObjFunction*);
         char* name = OBJ_AS_CSTRING(fn->name);
         chunk_print_with_name(&fn->chunk, name);
+        printf("%s: %d locals, %d stack slots\n\n", name, fn->local_count, fn->max_stack);
     }
 }
 
 void chunk_print(const Chunk* chunk) {
+    init_vector(&dumped_functions, sizeof(ObjFunction*));
     chunk_print_with_name(chunk, "<GLOBAL>");
+    free_vector(&dumped_functions);
 }
 
 static const char* token_type_print(TokenKind kind) {
@@ -20,5 +20,6 @@ void valuearray_print(const ValueArray* values);
 void ast_print(Stmt* ast);
 void stack_print(const Value* stack_top, Value* stack);
 void opcode_print(uint8_t op);
+const char* opcode_name(uint8_t op);
 
 #endif
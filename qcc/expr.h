@@ -26,6 +26,8 @@ typedef struct {
     struct s_expr* left;
     Token op;
     struct s_expr* right;
+    struct s_type* left_type;
+    struct s_type* right_type;
 } BinaryExpr;
 
 typedef struct {
@@ -0,0 +1,372 @@
+#include "gc_threads.h"
+
+_Thread_local GcWorker* gc_worker = NULL;
+
+#ifdef _WIN32
+
+int gc_default_threads() {
+    return 1;
+}
+
+void free_gc_threads() {}
+void gc_worker_mark(GcWorker* worker, Obj* obj) {}
+
+bool gc_mark_in_parallel(int threads, void (*blacken)(Obj*)) {
+    return false;
+}
+
+bool gc_run_in_background(void (*task)()) {
+    return false;
+}
+
+bool gc_background_running() {
+    return false;
+}
+
+bool gc_background_done() {
+    return true;
+}
+
+void gc_join_background() {}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "heap.h"
+#include "vm.h"
+#include "vm_memory.h"
+
+// Gray objects of a marking thread. The owner pushes and pops at the
+// bottom and the others steal from the top, all of them under a spin
+// lock. Size is also written under the lock, but can be read without it
+// to look for work.
+struct s_gc_worker {
+    Obj** items;
+    int capacity;
+    int top;
+    int bottom;
+    int size;
+    int lock;
+    pthread_t thread;
+};
+
+// Worker 0 is the interpreter thread, the helpers are the rest. They wait
+// on wake until the generation changes, which means there is a new mark
+// to help with.
+typedef struct {
+    GcWorker workers[GC_MAX_THREADS];
+    int helpers;
+    int marking;
+    int idle;
+    void (*blacken)(Obj*);
+    unsigned long generation;
+    unsigned long started_at; // Generation when the helpers were started
+    int finished;
+    bool shutting_down;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+} MarkPool;
+
+typedef struct {
+    pthread_t thread;
+    void (*task)();
+    bool running;
+    int done;
+} Background;
+
+static MarkPool pool = {
+    .helpers = 0,
+    .generation = 0,
+    .shutting_down = false,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static Background background = {
+    .running = false,
+};
+
+static void start_helpers(int helpers);
+static void stop_helpers();
+static void* helper_main(void* arg);
+static void mark_loop(GcWorker* self);
+static Obj* steal_work(GcWorker* self);
+static bool any_work();
+static void* background_main(void* arg);
+static int create_thread(pthread_t* thread, void* (*main)(void*), void* arg);
+
+static inline void lock_deque(GcWorker* worker) {
+    while (__atomic_exchange_n(&worker->lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&worker->lock, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+static inline void unlock_deque(GcWorker* worker) {
+    __atomic_store_n(&worker->lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void set_size(GcWorker* worker) {
+    __atomic_store_n(&worker->size, worker->bottom - worker->top, __ATOMIC_RELAXED);
+}
+
+static void push_deque(GcWorker* worker, Obj* obj) {
+    lock_deque(worker);
+    if (worker->bottom == worker->capacity) {
+        if (worker->top > 0) {
+            memmove(worker->items, &worker->items[worker->top], sizeof(Obj*) * (worker->bottom - worker->top));
+            worker->bottom -= worker->top;
+            worker->top = 0;
+        } else {
+            worker->capacity = GROW_CAPACITY(worker->capacity);
+            worker->items = (Obj**) realloc(worker->items, sizeof(Obj*) * worker->capacity);
+            if (worker->items == NULL) {
+                exit(1);
+            }
+        }
+    }
+    worker->items[worker->bottom++] = obj;
+    set_size(worker);
+    unlock_deque(worker);
+}
+
+static Obj* pop_deque(GcWorker* worker) {
+    Obj* obj = NULL;
+    lock_deque(worker);
+    if (worker->bottom > worker->top) {
+        obj = worker->items[--worker->bottom];
+    }
+    if (worker->bottom == worker->top) {
+        worker->bottom = 0;
+        worker->top = 0;
+    }
+    set_size(worker);
+    unlock_deque(worker);
+    return obj;
+}
+
+static Obj* steal_deque(GcWorker* worker) {
+    Obj* obj = NULL;
+    lock_deque(worker);
+    if (worker->bottom > worker->top) {
+        obj = worker->items[worker->top++];
+    }
+    set_size(worker);
+    unlock_deque(worker);
+    return obj;
+}
+
+int gc_default_threads() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return (cpus < GC_DEFAULT_MAX_THREADS) ? (int) cpus : GC_DEFAULT_MAX_THREADS;
+}
+
+void free_gc_threads() {
+    if (background.running) {
+        gc_join_background();
+    }
+    stop_helpers();
+    for (int i = 0; i < GC_MAX_THREADS; i++) {
+        free(pool.workers[i].items);
+        pool.workers[i].items = NULL;
+        pool.workers[i].capacity = 0;
+    }
+}
+
+void gc_worker_mark(GcWorker* worker, Obj* obj) {
+    if (! heap_try_mark(obj)) {
+        return;
+    }
+    push_deque(worker, obj);
+}
+
+bool gc_mark_in_parallel(int threads, void (*blacken)(Obj*)) {
+    if (threads > GC_MAX_THREADS) {
+        threads = GC_MAX_THREADS;
+    }
+    if (threads - 1 != pool.helpers) {
+        stop_helpers();
+        start_helpers(threads - 1);
+    }
+    if (pool.helpers == 0) {
+        return false;
+    }
+    pool.marking = pool.helpers + 1;
+    pool.idle = 0;
+    pool.blacken = blacken;
+    for (int i = 0; i < qvm.gray_stack_size; i++) {
+        push_deque(&pool.workers[i % pool.marking], qvm.gray_stack[i]);
+    }
+    qvm.gray_stack_size = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = 0;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    mark_loop(&pool.workers[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.finished < pool.helpers) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return true;
+}
+
+static void start_helpers(int helpers) {
+    pool.shutting_down = false;
+    pool.started_at = pool.generation;
+    pool.helpers = 0;
+    for (int i = 1; i <= helpers; i++) {
+        if (create_thread(&pool.workers[i].thread, helper_main, &pool.workers[i]) != 0) {
+            break;
+        }
+        pool.helpers++;
+    }
+}
+
+// The profiler samples the interpreter on SIGPROF, which may be delivered
+// to any thread that does not block it. The threads of the collector are
+// started with it blocked, and keep that mask.
+static int create_thread(pthread_t* thread, void* (*main)(void*), void* arg) {
+    sigset_t profiling;
+    sigset_t old;
+    sigemptyset(&profiling);
+    sigaddset(&profiling, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profiling, &old);
+    int result = pthread_create(thread, NULL, main, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return result;
+}
+
+static void stop_helpers() {
+    if (pool.helpers == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.shutting_down = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i <= pool.helpers; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    pool.helpers = 0;
+    pool.shutting_down = false;
+}
+
+static void* helper_main(void* arg) {
+    GcWorker* self = (GcWorker*) arg;
+    pthread_mutex_lock(&pool.lock);
+    unsigned long seen = pool.started_at;
+    for (;;) {
+        while (!pool.shutting_down && pool.generation == seen) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if (pool.shutting_down) {
+            break;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+        mark_loop(self);
+        pthread_mutex_lock(&pool.lock);
+        pool.finished++;
+        pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// A thread only goes idle with its own deque empty, and only the owner
+// pushes to a deque, so once every thread is idle there is nothing left.
+static void mark_loop(GcWorker* self) {
+    gc_worker = self;
+    for (;;) {
+        Obj* obj = pop_deque(self);
+        if (obj == NULL) {
+            obj = steal_work(self);
+        }
+        if (obj != NULL) {
+            pool.blacken(obj);
+            continue;
+        }
+        __atomic_add_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&pool.idle, __ATOMIC_SEQ_CST) == pool.marking) {
+                gc_worker = NULL;
+                return;
+            }
+            if (any_work()) {
+                __atomic_sub_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static Obj* steal_work(GcWorker* self) {
+    int start = (int) (self - pool.workers);
+    for (int i = 1; i < pool.marking; i++) {
+        GcWorker* victim = &pool.workers[(start + i) % pool.marking];
+        if (__atomic_load_n(&victim->size, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        Obj* obj = steal_deque(victim);
+        if (obj != NULL) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+static bool any_work() {
+    for (int i = 0; i < pool.marking; i++) {
+        if (__atomic_load_n(&pool.workers[i].size, __ATOMIC_RELAXED) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool gc_run_in_background(void (*task)()) {
+    assert(!background.running);
+    background.task = task;
+    __atomic_store_n(&background.done, 0, __ATOMIC_RELAXED);
+    if (create_thread(&background.thread, background_main, NULL) != 0) {
+        return false;
+    }
+    background.running = true;
+    return true;
+}
+
+bool gc_background_running() {
+    return background.running;
+}
+
+bool gc_background_done() {
+    return __atomic_load_n(&background.done, __ATOMIC_ACQUIRE);
+}
+
+void gc_join_background() {
+    pthread_join(background.thread, NULL);
+    background.running = false;
+}
+
+static void* background_main(void* arg) {
+    background.task();
+    __atomic_store_n(&background.done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+#endif
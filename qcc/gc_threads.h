@@ -0,0 +1,42 @@
+#ifndef QUARTZ_GC_THREADS_H_
+#define QUARTZ_GC_THREADS_H_
+
+// Threads of the collector. Marking threads drain the gray objects in
+// parallel with the interpreter thread, each one from its own deque and
+// stealing from the others when it runs out. A background thread runs the
+// sweep of a cycle while the program goes on. The number of threads is
+// set with QUARTZ_GC_THREADS or --gc-threads=<n>; with 1, or without
+// pthreads, the whole collector runs in the interpreter thread.
+
+#include "common.h"
+#include "object.h"
+
+#define GC_THREADS_ENV "QUARTZ_GC_THREADS"
+#define GC_MAX_THREADS 64
+#define GC_DEFAULT_MAX_THREADS 4
+
+typedef struct s_gc_worker GcWorker;
+
+// The worker of the running thread while it marks in parallel
+extern _Thread_local GcWorker* gc_worker;
+
+int gc_default_threads();
+void free_gc_threads();
+
+// Marks obj from a marking thread: only the thread that sets its mark bit
+// pushes it to its deque.
+void gc_worker_mark(GcWorker* worker, Obj* obj);
+
+// Blackens everything reachable from qvm.gray_stack with the given number
+// of threads, the calling one included. Returns false, having done nothing,
+// when they cannot be used.
+bool gc_mark_in_parallel(int threads, void (*blacken)(Obj*));
+
+// Runs task in the background thread. Returns false, having done nothing,
+// when it cannot be started.
+bool gc_run_in_background(void (*task)());
+bool gc_background_running();
+bool gc_background_done();
+void gc_join_background();
+
+#endif
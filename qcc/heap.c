@@ -0,0 +1,396 @@
+#include "heap.h"
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Slot sizes. Every object of up to HEAP_MAX_SMALL bytes takes the first
+// one it fits in.
+static const int class_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+};
+
+#define HEAP_CLASSES (int) (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+// The class of each size, by granules: the first one it fits in. It is
+// constant, so objects can be allocated before init_heap runs.
+static const uint8_t class_of[HEAP_MAX_SMALL / HEAP_GRANULE + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11,
+    11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15,
+    15, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17,
+    17, 18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19,
+    19,
+};
+
+#define PAGE_SLOT(page, index) ((Obj*) ((uint8_t*) (page) + HEAP_PAGE_HEADER + (size_t) (index) * (page)->slot_size))
+
+// The pages of a class the allocator owns, in the order they are looked
+// for free slots in: the cursor is the first one that may still have
+// some. While a sweep runs the class also has the pages not swept yet,
+// and the ones the background thread already swept.
+typedef struct {
+    HeapPage* first;
+    HeapPage* last;
+    HeapPage* cursor;
+    HeapPage* unswept;
+    HeapPage* swept;
+} SizeClass;
+
+// The unswept and swept lists are shared with the background thread, and
+// only touched under lock.
+typedef struct {
+    SizeClass classes[sizeof(class_sizes) / sizeof(class_sizes[0])];
+    HeapPage* large;
+    HeapPage* unswept_large;
+    HeapPage* swept_large;
+    bool sweeping;
+    int unswept_pages;
+    int next_class; // Where heap_sweep_step looks first
+    void (*free_data)(Obj*);
+    size_t freed;
+    int lock;
+} Heap;
+
+static Heap heap;
+
+static HeapPage* alloc_page(size_t size);
+static HeapPage* new_page(int size_class);
+static void free_page(HeapPage* page);
+static HeapPage* refill(int size_class);
+static void append_page(SizeClass* sc, HeapPage* page);
+static void sweep_page(HeapPage* page);
+static size_t sweep_and_keep(HeapPage* page);
+
+static inline void lock_heap() {
+    while (__atomic_exchange_n(&heap.lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&heap.lock, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+static inline void unlock_heap() {
+    __atomic_store_n(&heap.lock, 0, __ATOMIC_RELEASE);
+}
+
+// A heap that is all zeros is empty, so the static one can be used
+// before this runs.
+void init_heap() {
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        SizeClass* sc = &heap.classes[i];
+        sc->first = NULL;
+        sc->last = NULL;
+        sc->cursor = NULL;
+        sc->unswept = NULL;
+        sc->swept = NULL;
+    }
+    heap.large = NULL;
+    heap.unswept_large = NULL;
+    heap.swept_large = NULL;
+    heap.sweeping = false;
+    heap.unswept_pages = 0;
+    heap.next_class = 0;
+    heap.free_data = NULL;
+    heap.freed = 0;
+    heap.lock = 0;
+}
+
+static void free_pages(HeapPage* page, void (*free_data)(Obj*)) {
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        for (int slot = 0; slot < page->slots; slot++) {
+            if (page->allocated[slot / 64] & ((uint64_t) 1 << (slot % 64))) {
+                free_data(PAGE_SLOT(page, slot));
+            }
+        }
+        free_page(page);
+        page = next;
+    }
+}
+
+void free_heap(void (*free_data)(Obj*)) {
+    assert(! heap.sweeping);
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        free_pages(heap.classes[i].first, free_data);
+    }
+    free_pages(heap.large, free_data);
+    init_heap();
+}
+
+static HeapPage* alloc_page(size_t size) {
+    HeapPage* page = NULL;
+#ifdef _WIN32
+    page = (HeapPage*) _aligned_malloc(size, HEAP_PAGE_SIZE);
+#else
+    if (posix_memalign((void**) &page, HEAP_PAGE_SIZE, size) != 0) {
+        page = NULL;
+    }
+#endif
+    if (page == NULL) {
+        exit(1);
+    }
+    page->next = NULL;
+    page->free = NULL;
+    page->live = 0;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    memset(page->marked, 0, sizeof(page->marked));
+    return page;
+}
+
+static HeapPage* new_page(int size_class) {
+    HeapPage* page = alloc_page(HEAP_PAGE_SIZE);
+    page->size_class = size_class;
+    page->slot_size = class_sizes[size_class];
+    page->slot_reciprocal = (uint32_t) ((((uint64_t) 1 << 32) + page->slot_size - 1) / page->slot_size);
+    page->slots = (HEAP_PAGE_SIZE - HEAP_PAGE_HEADER) / page->slot_size;
+    for (int slot = page->slots - 1; slot >= 0; slot--) {
+        void** free_slot = (void**) PAGE_SLOT(page, slot);
+        *free_slot = page->free;
+        page->free = free_slot;
+    }
+    return page;
+}
+
+static void free_page(HeapPage* page) {
+#ifdef _WIN32
+    _aligned_free(page);
+#else
+    free(page);
+#endif
+}
+
+size_t heap_size_of(size_t size) {
+    if (size > HEAP_MAX_SMALL) {
+        return size;
+    }
+    return class_sizes[class_of[(size + HEAP_GRANULE - 1) / HEAP_GRANULE]];
+}
+
+size_t heap_take_freed() {
+    return __atomic_exchange_n(&heap.freed, 0, __ATOMIC_RELAXED);
+}
+
+Obj* heap_alloc(size_t size) {
+    if (size > HEAP_MAX_SMALL) {
+        if (heap.sweeping) {
+            // The memory of a dead one goes back before asking for more
+            lock_heap();
+            HeapPage* unswept = heap.unswept_large;
+            if (unswept != NULL) {
+                heap.unswept_large = unswept->next;
+                __atomic_sub_fetch(&heap.unswept_pages, 1, __ATOMIC_RELAXED);
+            }
+            unlock_heap();
+            if (unswept != NULL) {
+                sweep_and_keep(unswept);
+            }
+        }
+        HeapPage* page = alloc_page(HEAP_PAGE_HEADER + size);
+        page->size_class = HEAP_LARGE_CLASS;
+        page->slot_size = (int) size;
+        page->slot_reciprocal = 0;
+        page->slots = 1;
+        page->live = 1;
+        page->allocated[0] = 1;
+        page->next = heap.large;
+        heap.large = page;
+        return PAGE_SLOT(page, 0);
+    }
+    int size_class = class_of[(size + HEAP_GRANULE - 1) / HEAP_GRANULE];
+    SizeClass* sc = &heap.classes[size_class];
+    HeapPage* page = sc->cursor;
+    while (page != NULL && page->free == NULL) {
+        page = page->next;
+    }
+    if (page == NULL) {
+        page = refill(size_class);
+    }
+    sc->cursor = page;
+    void** slot = (void**) page->free;
+    page->free = *slot;
+    int index = heap_slot_index(page, (Obj*) slot);
+    page->allocated[index / 64] |= (uint64_t) 1 << (index % 64);
+    page->live++;
+    return (Obj*) slot;
+}
+
+// Finds a page with free slots for the class once its pages are full:
+// one the background thread swept, one not swept yet, which is swept
+// here, or a new one.
+static HeapPage* refill(int size_class) {
+    SizeClass* sc = &heap.classes[size_class];
+    while (heap.sweeping) {
+        bool needs_sweep = false;
+        lock_heap();
+        HeapPage* page = sc->swept;
+        if (page != NULL) {
+            sc->swept = page->next;
+        } else if (sc->unswept != NULL) {
+            page = sc->unswept;
+            sc->unswept = page->next;
+            __atomic_sub_fetch(&heap.unswept_pages, 1, __ATOMIC_RELAXED);
+            needs_sweep = true;
+        }
+        unlock_heap();
+        if (page == NULL) {
+            break;
+        }
+        if (needs_sweep) {
+            sweep_page(page);
+        }
+        append_page(sc, page);
+        if (page->free != NULL) {
+            return page;
+        }
+    }
+    HeapPage* page = new_page(size_class);
+    append_page(sc, page);
+    return page;
+}
+
+static void append_page(SizeClass* sc, HeapPage* page) {
+    page->next = NULL;
+    if (sc->last == NULL) {
+        sc->first = page;
+    } else {
+        sc->last->next = page;
+    }
+    sc->last = page;
+}
+
+// Frees the objects that are allocated but not marked, and clears the
+// marks for the next cycle.
+static void sweep_page(HeapPage* page) {
+    size_t freed = 0;
+    for (int word = 0; word < HEAP_MAP_WORDS; word++) {
+        uint64_t dead = page->allocated[word] & ~page->marked[word];
+        page->allocated[word] &= page->marked[word];
+        while (dead != 0) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            Obj* obj = PAGE_SLOT(page, word * 64 + bit);
+            heap.free_data(obj);
+#ifdef STRESS_GC
+            memset(obj, 0xAB, page->slot_size);
+#endif
+            void** free_slot = (void**) obj;
+            *free_slot = page->free;
+            page->free = free_slot;
+            page->live--;
+            freed += page->slot_size;
+        }
+    }
+    memset(page->marked, 0, sizeof(page->marked));
+    __atomic_add_fetch(&heap.freed, freed, __ATOMIC_RELAXED);
+}
+
+// Counts the pages of the list, and adds the bytes of their objects that
+// are not marked, and of what those objects own, to garbage.
+static int count_pages(HeapPage* page, size_t (*data_size)(Obj*), size_t* garbage) {
+    int count = 0;
+    for (; page != NULL; page = page->next) {
+        for (int word = 0; word < HEAP_MAP_WORDS; word++) {
+            uint64_t dead = page->allocated[word] & ~page->marked[word];
+            while (dead != 0) {
+                int bit = __builtin_ctzll(dead);
+                dead &= dead - 1;
+                *garbage += page->slot_size + data_size(PAGE_SLOT(page, word * 64 + bit));
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+size_t heap_start_sweep(void (*free_data)(Obj*), size_t (*data_size)(Obj*)) {
+    assert(! heap.sweeping);
+    size_t garbage = 0;
+    int pages = 0;
+    heap.free_data = free_data;
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        SizeClass* sc = &heap.classes[i];
+        sc->unswept = sc->first;
+        pages += count_pages(sc->first, data_size, &garbage);
+        sc->first = NULL;
+        sc->last = NULL;
+        sc->cursor = NULL;
+    }
+    heap.unswept_large = heap.large;
+    pages += count_pages(heap.large, data_size, &garbage);
+    heap.large = NULL;
+    heap.unswept_pages = pages;
+    heap.sweeping = true;
+    return garbage;
+}
+
+size_t heap_sweep_step() {
+    lock_heap();
+    HeapPage* page = heap.unswept_large;
+    if (page != NULL) {
+        heap.unswept_large = page->next;
+    }
+    for (int i = 0; page == NULL && i < HEAP_CLASSES; i++) {
+        SizeClass* sc = &heap.classes[(heap.next_class + i) % HEAP_CLASSES];
+        if (sc->unswept != NULL) {
+            page = sc->unswept;
+            sc->unswept = page->next;
+            heap.next_class = page->size_class;
+        }
+    }
+    if (page != NULL) {
+        __atomic_sub_fetch(&heap.unswept_pages, 1, __ATOMIC_RELAXED);
+    }
+    unlock_heap();
+    if (page == NULL) {
+        return 0;
+    }
+    return sweep_and_keep(page);
+}
+
+// Sweeps a page taken from the unswept ones, and frees it if it is empty
+// or leaves it with the swept ones otherwise. Returns the bytes visited.
+static size_t sweep_and_keep(HeapPage* page) {
+    bool large = page->size_class == HEAP_LARGE_CLASS;
+    size_t visited = large ? HEAP_PAGE_HEADER + page->slot_size : HEAP_PAGE_SIZE;
+    sweep_page(page);
+    if (page->live == 0) {
+        free_page(page);
+        return visited;
+    }
+    lock_heap();
+    HeapPage** swept = large ? &heap.swept_large : &heap.classes[page->size_class].swept;
+    page->next = *swept;
+    *swept = page;
+    unlock_heap();
+    return visited;
+}
+
+bool heap_sweep_done() {
+    return __atomic_load_n(&heap.unswept_pages, __ATOMIC_RELAXED) == 0;
+}
+
+void heap_finish_sweep() {
+    assert(heap_sweep_done());
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        SizeClass* sc = &heap.classes[i];
+        HeapPage* page = sc->swept;
+        while (page != NULL) {
+            HeapPage* next = page->next;
+            append_page(sc, page);
+            page = next;
+        }
+        sc->swept = NULL;
+        sc->cursor = sc->first;
+    }
+    HeapPage* page = heap.swept_large;
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        page->next = heap.large;
+        heap.large = page;
+        page = next;
+    }
+    heap.swept_large = NULL;
+    heap.sweeping = false;
+}
@@ -0,0 +1,94 @@
+#ifndef QUARTZ_HEAP_H_
+#define QUARTZ_HEAP_H_
+
+// Memory of the old generation. Small objects live in pages of one size
+// class each, and bigger ones in a page of their own. Pages are aligned
+// to HEAP_PAGE_SIZE, so the page of an object is its address masked, and
+// keep two bitmaps of their slots: the ones in use and the ones marked.
+// Marking only writes the second one, and clearing the marks is a memset.
+//
+// Pages are swept lazily: when marking ends they are all left unswept,
+// and the allocator sweeps one of the class it needs before taking a new
+// page. The collector sweeps the rest in its slices, or a background
+// thread does, before the next cycle starts.
+
+#include "common.h"
+#include "object.h"
+
+#define HEAP_PAGE_SIZE (32 * 1024)
+#define HEAP_MAX_SMALL 1024
+#define HEAP_GRANULE 16
+#define HEAP_MAX_SLOTS (HEAP_PAGE_SIZE / HEAP_GRANULE)
+#define HEAP_MAP_WORDS (HEAP_MAX_SLOTS / 64)
+#define HEAP_LARGE_CLASS -1
+
+typedef struct s_heap_page HeapPage;
+
+struct s_heap_page {
+    HeapPage* next; // Next page of its list
+    void* free; // Free slots, linked through their first word
+    int size_class;
+    int slot_size;
+    uint32_t slot_reciprocal; // 2^32 / slot_size, rounded up
+    int slots;
+    int live;
+    uint64_t allocated[HEAP_MAP_WORDS];
+    uint64_t marked[HEAP_MAP_WORDS];
+};
+
+// The slots of a page start after its header
+#define HEAP_PAGE_HEADER ((sizeof(HeapPage) + HEAP_GRANULE - 1) & ~((size_t) HEAP_GRANULE - 1))
+#define HEAP_PAGE_OF(obj) ((HeapPage*) ((uintptr_t) (obj) & ~((uintptr_t) HEAP_PAGE_SIZE - 1)))
+
+void init_heap();
+void free_heap(void (*free_data)(Obj*));
+
+Obj* heap_alloc(size_t size);
+size_t heap_size_of(size_t size);
+
+// Bytes of the slots freed by the sweeps since the last call
+size_t heap_take_freed();
+
+// Leaves every page unswept, and returns the bytes of the objects that are
+// not marked: their slots, plus what data_size says each one owns.
+// free_data is called for each dead object before its slot is reused.
+size_t heap_start_sweep(void (*free_data)(Obj*), size_t (*data_size)(Obj*));
+// Sweeps an unswept page, from any thread. Returns the bytes visited, or
+// 0 when there are none left.
+size_t heap_sweep_step();
+bool heap_sweep_done();
+// Gives the pages swept by heap_sweep_step back to the allocator, once
+// every page is swept.
+void heap_finish_sweep();
+
+// Slot offsets are multiples of the slot size and smaller than a page, so
+// multiplying by the reciprocal divides exactly.
+static inline int heap_slot_index(HeapPage* page, Obj* obj) {
+    uint64_t offset = (uint64_t) ((uint8_t*) obj - (uint8_t*) page - HEAP_PAGE_HEADER);
+    return (int) ((offset * page->slot_reciprocal) >> 32);
+}
+
+static inline bool heap_is_marked(Obj* obj) {
+    HeapPage* page = HEAP_PAGE_OF(obj);
+    int index = heap_slot_index(page, obj);
+    return (page->marked[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void heap_set_mark(Obj* obj) {
+    HeapPage* page = HEAP_PAGE_OF(obj);
+    int index = heap_slot_index(page, obj);
+    page->marked[index / 64] |= (uint64_t) 1 << (index % 64);
+}
+
+// For marking threads. Returns true only to the one that sets the mark.
+static inline bool heap_try_mark(Obj* obj) {
+    HeapPage* page = HEAP_PAGE_OF(obj);
+    int index = heap_slot_index(page, obj);
+    uint64_t bit = (uint64_t) 1 << (index % 64);
+    if (__atomic_load_n(&page->marked[index / 64], __ATOMIC_RELAXED) & bit) {
+        return false;
+    }
+    return (__atomic_fetch_or(&page->marked[index / 64], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+
+#endif
@@ -19,7 +19,7 @@ CTable modules; // Ctable<Import>
 
 static bool is_directory(const char* path);
 static bool is_import_loaded(const char* path, int len);
-static Import find_import(const char* path, int lengh);
+static Import* find_import(const char* path, int lengh);
 static void register_import(Import import, const char* path, int length);
 static const char* read_file(const char* source_name);
 FileImport import_file(const char* path, int length);
@@ -58,12 +58,12 @@ static bool is_import_loaded(const char* path, int length) {
     return entry != NULL;
 }
 
-static Import find_import(const char* path, int length) {
+static Import* find_import(const char* path, int length) {
     CTableKey key = create_ctable_key(path, length);
     CTableEntry* entry = FIND_IMPORT(key);
     assert(entry != NULL);
     Import* mods = VECTOR_AS_IMPORTS();
-    return mods[entry->vector_pos];
+    return &mods[entry->vector_pos];
 }
 
 static void register_import(Import import, const char* path, int length) {
@@ -104,7 +104,11 @@ static const char* read_file(const char* source_name) {
 
 Import import(const char* path, int length) {
     if (is_import_loaded(path, length)) {
-        return find_import(path, length);
+        Import* found = find_import(path, length);
+        Import import = *found;
+        // Preloaded files are parsed the first time they are imported
+        found->is_already_loaded = true;
+        return import;
     }
 
     Import import;
@@ -136,6 +140,32 @@ FileImport import_file(const char* path, int length) {
     return import;
 }
 
+void import_preload(const char* path, int length, const char* source) {
+    int source_length = strlen(source);
+    char* cpy_path = (char*) malloc(sizeof(char) * length + 1);
+    char* cpy_source = (char*) malloc(sizeof(char) * source_length + 1);
+    memcpy(cpy_path, path, length);
+    cpy_path[length] = '\0';
+    memcpy(cpy_source, source, source_length + 1);
+
+    Import import;
+    import.is_native = false;
+    import.is_already_loaded = false;
+    import.file.path = cpy_path;
+    import.file.path_length = length;
+    import.file.source = cpy_source;
+    register_import(import, path, length);
+}
+
+void import_for_each_file(void (*fn)(FileImport file, void* ctx), void* ctx) {
+    Import* mods = VECTOR_AS_IMPORTS();
+    for (uint32_t i = 0; i < modules.data.size; i++) {
+        if (! mods[i].is_native && mods[i].file.source != NULL) {
+            fn(mods[i].file, ctx);
+        }
+    }
+}
+
 static void free_import(Import import) {
     if (import.is_native) {
         return;
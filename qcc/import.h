@@ -17,5 +17,10 @@ typedef struct {
 void init_module_system();
 void free_module_system();
 Import import(const char* path, int length);
+// Registers a file whose source is already in memory, so importing it
+// does not read the disk. The path and the source are copied.
+void import_preload(const char* path, int length, const char* source);
+// Calls fn with each file imported so far, in the order they were imported.
+void import_for_each_file(void (*fn)(FileImport file, void* ctx), void* ctx);
 
 #endif
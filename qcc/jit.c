@@ -0,0 +1,632 @@
+#include "jit.h"
+
+#ifndef JIT_AVAILABLE
+
+bool jit_compile(ObjFunction* func) {
+    func->hotness = INT32_MIN;
+    return false;
+}
+
+void free_jit() {}
+void free_jit_code(JitCode* code) {}
+
+#else
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+
+// All native code lives in one mapping that is only writable while a
+// function is being compiled.
+#define JIT_ARENA_SIZE (16 * 1024 * 1024)
+
+// Upper bound of native bytes per bytecode byte, used to reserve memory.
+#define JIT_BYTES_PER_OP 96
+
+#define JIT_NO_TARGET -1
+
+// x86-64 registers
+#define RAX 0
+#define RCX 1
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+#define XMM0 0
+#define XMM1 1
+
+// Registers pinned while native code runs
+#define SLOTS RBX
+#define STACK_TOP R12
+#define CONSTANTS R13
+#define GLOBALS R14
+#define STATE R15
+
+// Condition codes
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_P 0xA
+#define CC_NP 0xB
+
+#define VALUE_SIZE ((int32_t) sizeof(Value))
+
+// Displacement of the value at the given distance from the stack top
+#define PEEK_DISP(distance) (-((distance) + 1) * VALUE_SIZE)
+
+typedef struct {
+    int native; // Position of the rel32 to patch
+    int target; // Bytecode offset the jump goes to
+} JumpFixup;
+
+typedef struct {
+    const Chunk* chunk;
+    uint8_t* code;
+    int size;
+    int capacity;
+    int* targets;
+    void** entries; // Jump table of the prologue, filled in at the end
+    JumpFixup* fixups;
+    int fixup_count;
+    int exit;
+} Assembler;
+
+typedef struct {
+    uint8_t* memory;
+    size_t used;
+    FILE* perf_map;
+} JitArena;
+
+static JitArena arena = { .memory = NULL, .used = 0, .perf_map = NULL };
+
+static bool init_arena();
+static void write_perf_map(const ObjFunction* func, const uint8_t* code, int size);
+static bool compile_chunk(Assembler* const a);
+static int compile_instruction(Assembler* const a, int offset);
+
+// Raw encoding
+
+static inline void emit_byte(Assembler* const a, uint8_t byte) {
+    a->code[a->size++] = byte;
+}
+
+static inline void emit_int32(Assembler* const a, int32_t value) {
+    memcpy(&a->code[a->size], &value, sizeof(int32_t));
+    a->size += sizeof(int32_t);
+}
+
+static inline void emit_int64(Assembler* const a, uint64_t value) {
+    memcpy(&a->code[a->size], &value, sizeof(uint64_t));
+    a->size += sizeof(uint64_t);
+}
+
+static inline void emit_rex(Assembler* const a, bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40) {
+        emit_byte(a, rex);
+    }
+}
+
+// ModRM for [base + disp32]. Bases with low bits 100 (r12) need a SIB.
+static inline void emit_mem(Assembler* const a, int reg, int base, int32_t disp) {
+    emit_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) {
+        emit_byte(a, 0x24);
+    }
+    emit_int32(a, disp);
+}
+
+// Instructions
+
+static void asm_load(Assembler* const a, int reg, int base, int32_t disp) {
+    emit_rex(a, true, reg, base);
+    emit_byte(a, 0x8B);
+    emit_mem(a, reg, base, disp);
+}
+
+static void asm_store(Assembler* const a, int base, int32_t disp, int reg) {
+    emit_rex(a, true, reg, base);
+    emit_byte(a, 0x89);
+    emit_mem(a, reg, base, disp);
+}
+
+static void asm_mov_imm64(Assembler* const a, int reg, uint64_t value) {
+    emit_rex(a, true, 0, reg);
+    emit_byte(a, 0xB8 | (reg & 7));
+    emit_int64(a, value);
+}
+
+// lea reg, [reg + disp]: moves the stack top without touching the flags
+static void asm_add(Assembler* const a, int reg, int32_t disp) {
+    emit_rex(a, true, reg, reg);
+    emit_byte(a, 0x8D);
+    emit_mem(a, reg, reg, disp);
+}
+
+// SSE2 scalar double operation (movsd, addsd, ucomisd...) with memory
+static void asm_sse(Assembler* const a, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp) {
+    emit_byte(a, prefix);
+    emit_rex(a, false, xmm, base);
+    emit_byte(a, 0x0F);
+    emit_byte(a, op);
+    emit_mem(a, xmm, base, disp);
+}
+
+#define MOVSD_LOAD(a, xmm, base, disp) asm_sse(a, 0xF2, 0x10, xmm, base, disp)
+#define MOVSD_STORE(a, base, disp, xmm) asm_sse(a, 0xF2, 0x11, xmm, base, disp)
+#define UCOMISD(a, xmm, base, disp) asm_sse(a, 0x66, 0x2E, xmm, base, disp)
+
+static void asm_push(Assembler* const a, int reg) {
+    emit_rex(a, false, 0, reg);
+    emit_byte(a, 0x50 | (reg & 7));
+}
+
+static void asm_pop(Assembler* const a, int reg) {
+    emit_rex(a, false, 0, reg);
+    emit_byte(a, 0x58 | (reg & 7));
+}
+
+// setcc into al (first) or cl
+static void asm_setcc(Assembler* const a, uint8_t cc, int reg) {
+    emit_byte(a, 0x0F);
+    emit_byte(a, 0x90 | cc);
+    emit_byte(a, 0xC0 | reg);
+}
+
+// Emits a rel32 jump (jmp when cc is -1) to a bytecode offset. Forward
+// targets are patched once the whole chunk is compiled.
+static void asm_jump(Assembler* const a, int cc, int target) {
+    if (cc < 0) {
+        emit_byte(a, 0xE9);
+    } else {
+        emit_byte(a, 0x0F);
+        emit_byte(a, 0x80 | cc);
+    }
+    a->fixups[a->fixup_count++] = (JumpFixup){ .native = a->size, .target = target };
+    emit_int32(a, 0);
+}
+
+static void asm_exit(Assembler* const a, int offset) {
+    emit_byte(a, 0xB8); // mov eax, offset
+    emit_int32(a, offset);
+    emit_byte(a, 0xE9); // jmp exit
+    emit_int32(a, a->exit - (a->size + 4));
+}
+
+// Value templates
+
+static void copy_value(Assembler* const a, int dst, int32_t dst_disp, int src, int32_t src_disp) {
+    asm_load(a, RAX, src, src_disp);
+    asm_store(a, dst, dst_disp, RAX);
+}
+
+static void push_value(Assembler* const a, int src, int32_t src_disp) {
+    copy_value(a, STACK_TOP, 0, src, src_disp);
+    asm_add(a, STACK_TOP, VALUE_SIZE);
+}
+
+// Stores xmm0 as a number at disp from the stack top
+static void store_number(Assembler* const a, int32_t disp) {
+    MOVSD_STORE(a, STACK_TOP, disp, XMM0);
+}
+
+// Stores al (0 or 1) as a Bool at disp from the stack top. True is the
+// word right after false.
+static void store_bool(Assembler* const a, int32_t disp) {
+    emit_byte(a, 0x0F); // movzx eax, al
+    emit_byte(a, 0xB6);
+    emit_byte(a, 0xC0);
+    asm_mov_imm64(a, RCX, VALUE_FALSE_BITS);
+    emit_byte(a, 0x48); // add rax, rcx
+    emit_byte(a, 0x01);
+    emit_byte(a, 0xC8);
+    asm_store(a, STACK_TOP, disp, RAX);
+}
+
+static void num_binary(Assembler* const a, uint8_t sse_op) {
+    MOVSD_LOAD(a, XMM0, STACK_TOP, PEEK_DISP(1));
+    asm_sse(a, 0xF2, sse_op, XMM0, STACK_TOP, PEEK_DISP(0));
+    store_number(a, PEEK_DISP(1));
+    asm_add(a, STACK_TOP, -VALUE_SIZE);
+}
+
+// Compares the two numbers on top of the stack. With swap the comparison
+// is b against a, so lower and lower equal can use the unordered-safe
+// above conditions.
+static void num_compare(Assembler* const a, bool swap) {
+    int first = swap ? PEEK_DISP(0) : PEEK_DISP(1);
+    int second = swap ? PEEK_DISP(1) : PEEK_DISP(0);
+    MOVSD_LOAD(a, XMM0, STACK_TOP, first);
+    UCOMISD(a, XMM0, STACK_TOP, second);
+}
+
+static void num_compare_op(Assembler* const a, bool swap, uint8_t cc) {
+    num_compare(a, swap);
+    asm_setcc(a, cc, RAX);
+    store_bool(a, PEEK_DISP(1));
+    asm_add(a, STACK_TOP, -VALUE_SIZE);
+}
+
+static void num_equal_op(Assembler* const a, bool equal) {
+    num_compare(a, false);
+    asm_setcc(a, equal ? CC_E : CC_NE, RAX);
+    asm_setcc(a, equal ? CC_NP : CC_P, RCX);
+    emit_byte(a, equal ? 0x20 : 0x08); // and al, cl / or al, cl
+    emit_byte(a, 0xC8);
+    store_bool(a, PEEK_DISP(1));
+    asm_add(a, STACK_TOP, -VALUE_SIZE);
+}
+
+// Pops both numbers and jumps to target when cc holds
+static void num_compare_jump(Assembler* const a, bool swap, uint8_t cc, int target) {
+    num_compare(a, swap);
+    asm_add(a, STACK_TOP, -2 * VALUE_SIZE);
+    asm_jump(a, cc, target);
+}
+
+// Loads into reg an upvalue of the running closure
+static void load_upvalue(Assembler* const a, int reg, int index) {
+    asm_load(a, reg, STATE, offsetof(JitState, closure));
+    asm_load(a, reg, reg, offsetof(ObjClosure, upvalues) + index * sizeof(ObjUpvalue*));
+}
+
+// Loads into reg where the upvalue of the running closure points to
+static void load_upvalue_location(Assembler* const a, int reg, int index) {
+    load_upvalue(a, reg, index);
+    asm_load(a, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+static void push_bool(Assembler* const a, bool value) {
+    emit_byte(a, 0xB0); // mov al, value
+    emit_byte(a, value);
+    store_bool(a, 0);
+    asm_add(a, STACK_TOP, VALUE_SIZE);
+}
+
+// Entry and exit
+
+static void compile_entry(Assembler* const a) {
+    asm_push(a, RBX);
+    asm_push(a, R12);
+    asm_push(a, R13);
+    asm_push(a, R14);
+    asm_push(a, R15);
+    emit_rex(a, true, RDI, STATE); // mov r15, rdi
+    emit_byte(a, 0x89);
+    emit_byte(a, 0xC0 | ((RDI & 7) << 3) | (STATE & 7));
+    asm_load(a, SLOTS, STATE, offsetof(JitState, slots));
+    asm_load(a, STACK_TOP, STATE, offsetof(JitState, stack_top));
+    asm_load(a, CONSTANTS, STATE, offsetof(JitState, constants));
+    asm_load(a, GLOBALS, STATE, offsetof(JitState, globals));
+    emit_byte(a, 0x89); // mov esi, esi
+    emit_byte(a, 0xF6);
+    asm_mov_imm64(a, RAX, (uint64_t) (uintptr_t) a->entries);
+    emit_byte(a, 0xFF); // jmp [rax + rsi * 8]
+    emit_byte(a, 0x24);
+    emit_byte(a, 0xF0);
+
+    a->exit = a->size;
+    asm_store(a, STATE, offsetof(JitState, stack_top), STACK_TOP);
+    asm_pop(a, R15);
+    asm_pop(a, R14);
+    asm_pop(a, R13);
+    asm_pop(a, R12);
+    asm_pop(a, RBX);
+    emit_byte(a, 0xC3); // ret
+}
+
+bool jit_compile(ObjFunction* func) {
+    const Chunk* chunk = &func->chunk;
+    size_t reserve = (size_t) chunk->size * JIT_BYTES_PER_OP + 256;
+    if (! init_arena() || arena.used + reserve > JIT_ARENA_SIZE) {
+        func->hotness = INT32_MIN;
+        return false;
+    }
+
+    Assembler a;
+    a.chunk = chunk;
+    a.code = arena.memory + arena.used;
+    a.size = 0;
+    a.capacity = reserve;
+    a.targets = (int*) malloc(sizeof(int) * (chunk->size + 1));
+    a.entries = (void**) malloc(sizeof(void*) * (chunk->size + 1));
+    a.fixups = (JumpFixup*) malloc(sizeof(JumpFixup) * (chunk->size + 1));
+    a.fixup_count = 0;
+    if (a.targets == NULL || a.entries == NULL || a.fixups == NULL) {
+        exit(1);
+    }
+
+    mprotect(arena.memory, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE);
+    bool compiled = compile_chunk(&a);
+    mprotect(arena.memory, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC);
+    free(a.fixups);
+    if (! compiled) {
+        free(a.targets);
+        free(a.entries);
+        func->hotness = INT32_MIN;
+        return false;
+    }
+
+    JitCode* code = (JitCode*) malloc(sizeof(JitCode));
+    if (code == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i <= chunk->size; i++) {
+        a.entries[i] = (a.targets[i] == JIT_NO_TARGET) ? NULL : a.code + a.targets[i];
+    }
+    free(a.targets);
+    // ISO C has no cast from data to function pointers, but the bytes of
+    // one are the address of the code on every target the JIT supports
+    memcpy(&code->entry, &a.code, sizeof(code->entry));
+    code->entries = a.entries;
+    arena.used += (a.size + 15) & ~15;
+    func->jit = code;
+    write_perf_map(func, a.code, a.size);
+    return true;
+}
+
+static bool compile_chunk(Assembler* const a) {
+    compile_entry(a);
+    for (int i = 0; i <= a->chunk->size; i++) {
+        a->targets[i] = JIT_NO_TARGET;
+    }
+    int offset = 0;
+    while (offset < a->chunk->size) {
+        a->targets[offset] = a->size;
+        offset = compile_instruction(a, offset);
+    }
+    // Falling off the end can only happen in malformed chunks
+    a->targets[offset] = a->size;
+    asm_exit(a, offset);
+    assert(a->size <= a->capacity);
+
+    for (int i = 0; i < a->fixup_count; i++) {
+        JumpFixup* fixup = &a->fixups[i];
+        if (fixup->target > a->chunk->size || a->targets[fixup->target] == JIT_NO_TARGET) {
+            return false;
+        }
+        int32_t rel = a->targets[fixup->target] - (fixup->native + 4);
+        memcpy(&a->code[fixup->native], &rel, sizeof(int32_t));
+    }
+    return true;
+}
+
+// Compiles the instruction at offset and returns the offset of the next
+// one. Opcodes without template return to the interpreter.
+static int compile_instruction(Assembler* const a, int offset) {
+    const uint8_t* code = a->chunk->code;
+    uint8_t op = code[offset];
+    int next = offset + opcode_length(op);
+#define BYTE(n) (code[offset + (n)])
+#define LONG(n) ((uint16_t) ((code[offset + (n)] << 8) | code[offset + (n) + 1]))
+
+    switch (op) {
+    case OP_NOP:
+        break;
+    case OP_POP:
+        asm_add(a, STACK_TOP, -VALUE_SIZE);
+        break;
+    case OP_TRUE:
+        push_bool(a, true);
+        break;
+    case OP_FALSE:
+        push_bool(a, false);
+        break;
+    case OP_CONSTANT:
+        push_value(a, CONSTANTS, BYTE(1) * VALUE_SIZE);
+        break;
+    case OP_CONSTANT_LONG:
+        push_value(a, CONSTANTS, LONG(1) * VALUE_SIZE);
+        break;
+    case OP_GET_GLOBAL:
+        push_value(a, GLOBALS, BYTE(1) * VALUE_SIZE);
+        break;
+    case OP_GET_GLOBAL_LONG:
+        push_value(a, GLOBALS, LONG(1) * VALUE_SIZE);
+        break;
+    case OP_SET_GLOBAL:
+        copy_value(a, GLOBALS, BYTE(1) * VALUE_SIZE, STACK_TOP, PEEK_DISP(0));
+        break;
+    case OP_SET_GLOBAL_LONG:
+        copy_value(a, GLOBALS, LONG(1) * VALUE_SIZE, STACK_TOP, PEEK_DISP(0));
+        break;
+    case OP_GET_LOCAL:
+        push_value(a, SLOTS, BYTE(1) * VALUE_SIZE);
+        break;
+    case OP_SET_LOCAL:
+        copy_value(a, SLOTS, BYTE(1) * VALUE_SIZE, STACK_TOP, PEEK_DISP(0));
+        break;
+    case OP_GET_LOCALS:
+        push_value(a, SLOTS, BYTE(1) * VALUE_SIZE);
+        push_value(a, SLOTS, BYTE(2) * VALUE_SIZE);
+        break;
+    case OP_GET_LOCAL_CONSTANT:
+        push_value(a, SLOTS, BYTE(1) * VALUE_SIZE);
+        push_value(a, CONSTANTS, BYTE(2) * VALUE_SIZE);
+        break;
+    case OP_SET_LOCAL_POP:
+        asm_add(a, STACK_TOP, -VALUE_SIZE);
+        copy_value(a, SLOTS, BYTE(1) * VALUE_SIZE, STACK_TOP, 0);
+        break;
+    case OP_GET_UPVALUE:
+        load_upvalue_location(a, RAX, BYTE(1));
+        push_value(a, RAX, 0);
+        break;
+    case OP_SET_UPVALUE:
+        // Stores into closed upvalues need the write barrier (see vm.h), so
+        // those return to the interpreter. Open ones write a stack slot.
+        load_upvalue(a, RAX, BYTE(1));
+        asm_load(a, RCX, RAX, offsetof(ObjUpvalue, location));
+        asm_add(a, RAX, offsetof(ObjUpvalue, closed));
+        emit_byte(a, 0x48); // cmp rcx, rax
+        emit_byte(a, 0x39);
+        emit_byte(a, 0xC1);
+        emit_byte(a, 0x75); // jne over the exit
+        emit_byte(a, 10);
+        asm_exit(a, offset);
+        copy_value(a, RCX, 0, STACK_TOP, PEEK_DISP(0));
+        break;
+    case OP_INCREMENT_LOCAL: {
+        int32_t local = BYTE(1) * VALUE_SIZE;
+        MOVSD_LOAD(a, XMM0, SLOTS, local);
+        asm_sse(a, 0xF2, 0x58, XMM0, CONSTANTS, BYTE(2) * VALUE_SIZE);
+        MOVSD_STORE(a, SLOTS, local, XMM0);
+        break;
+    }
+    case OP_ADD_NUM:
+        num_binary(a, 0x58);
+        break;
+    case OP_SUB:
+        num_binary(a, 0x5C);
+        break;
+    case OP_MUL:
+        num_binary(a, 0x59);
+        break;
+    case OP_DIV:
+        num_binary(a, 0x5E);
+        break;
+    case OP_MOD:
+        // The entry pushes keep the stack aligned for calls to C.
+        MOVSD_LOAD(a, XMM0, STACK_TOP, PEEK_DISP(1));
+        MOVSD_LOAD(a, XMM1, STACK_TOP, PEEK_DISP(0));
+        asm_mov_imm64(a, RAX, (uint64_t) (uintptr_t) fmod);
+        emit_byte(a, 0xFF); // call rax
+        emit_byte(a, 0xD0);
+        store_number(a, PEEK_DISP(1));
+        asm_add(a, STACK_TOP, -VALUE_SIZE);
+        break;
+    case OP_NEGATE:
+        asm_mov_imm64(a, RAX, 0x8000000000000000ULL); // Flip the sign bit
+        asm_load(a, RCX, STACK_TOP, PEEK_DISP(0));
+        emit_byte(a, 0x48); // xor rax, rcx
+        emit_byte(a, 0x31);
+        emit_byte(a, 0xC8);
+        asm_store(a, STACK_TOP, PEEK_DISP(0), RAX);
+        break;
+    case OP_GREATER:
+        num_compare_op(a, false, CC_A);
+        break;
+    case OP_GREATER_EQUAL:
+        num_compare_op(a, false, CC_AE);
+        break;
+    case OP_LOWER:
+        num_compare_op(a, true, CC_A);
+        break;
+    case OP_LOWER_EQUAL:
+        num_compare_op(a, true, CC_AE);
+        break;
+    case OP_EQUAL_NUM:
+        num_equal_op(a, true);
+        break;
+    case OP_NOT_EQUAL_NUM:
+        num_equal_op(a, false);
+        break;
+    case OP_JUMP:
+        asm_jump(a, -1, next + LONG(1));
+        break;
+    case OP_LOOP:
+        asm_jump(a, -1, next - LONG(1));
+        break;
+    case OP_JUMP_IF_FALSE:
+        asm_add(a, STACK_TOP, -VALUE_SIZE);
+        asm_mov_imm64(a, RAX, VALUE_TRUE_BITS);
+        emit_rex(a, true, RAX, STACK_TOP); // cmp [r12], rax
+        emit_byte(a, 0x39);
+        emit_mem(a, RAX, STACK_TOP, 0);
+        asm_jump(a, CC_NE, next + LONG(1));
+        break;
+    // Each one jumps when its comparison does not hold, unordered included
+    case OP_JUMP_IF_NOT_LOWER:
+        num_compare_jump(a, true, CC_BE, next + LONG(1));
+        break;
+    case OP_JUMP_IF_NOT_LOWER_EQUAL:
+        num_compare_jump(a, true, CC_B, next + LONG(1));
+        break;
+    case OP_JUMP_IF_NOT_GREATER:
+        num_compare_jump(a, false, CC_BE, next + LONG(1));
+        break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        num_compare_jump(a, false, CC_B, next + LONG(1));
+        break;
+    case OP_JUMP_IF_NOT_EQUAL:
+        num_compare_jump(a, false, CC_NE, next + LONG(1));
+        asm_jump(a, CC_P, next + LONG(1));
+        break;
+    case OP_JUMP_IF_EQUAL:
+        num_compare(a, false);
+        asm_add(a, STACK_TOP, -2 * VALUE_SIZE);
+        emit_byte(a, 0x7A); // jp over the jump
+        emit_byte(a, 6);
+        asm_jump(a, CC_E, next + LONG(1));
+        break;
+    default:
+        asm_exit(a, offset);
+        break;
+    }
+#undef BYTE
+#undef LONG
+    return next;
+}
+
+static bool init_arena() {
+    if (arena.memory != NULL) {
+        return true;
+    }
+    void* memory = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    arena.memory = (uint8_t*) memory;
+    arena.used = 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int) getpid());
+    arena.perf_map = fopen(path, "w");
+    return true;
+}
+
+// perf reads /tmp/perf-<pid>.map to name the code it finds in the arena.
+static void write_perf_map(const ObjFunction* func, const uint8_t* code, int size) {
+    if (arena.perf_map == NULL) {
+        return;
+    }
+    fprintf(
+        arena.perf_map,
+        "%lx %x quartz:%.*s\n",
+        (unsigned long) (uintptr_t) code,
+        size,
+        func->name->length,
+        func->name->chars);
+    fflush(arena.perf_map);
+}
+
+void free_jit_code(JitCode* code) {
+    if (code == NULL) {
+        return;
+    }
+    free(code->entries);
+    free(code);
+}
+
+void free_jit() {
+    if (arena.memory == NULL) {
+        return;
+    }
+    munmap(arena.memory, JIT_ARENA_SIZE);
+    arena.memory = NULL;
+    arena.used = 0;
+    if (arena.perf_map != NULL) {
+        fclose(arena.perf_map);
+        arena.perf_map = NULL;
+    }
+}
+
+#endif
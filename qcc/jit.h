@@ -0,0 +1,60 @@
+#ifndef QUARTZ_JIT_H_
+#define QUARTZ_JIT_H_
+
+// Baseline JIT, enabled with --jit. Functions whose call and loop counters
+// reach JIT_HOTNESS_THRESHOLD are translated, one template per opcode, to
+// x86-64 code. The native code works on the same stack and slots as the
+// interpreter, so it can be entered at the start of any instruction and
+// returns to the interpreter at the first opcode it does not implement.
+
+#include "common.h"
+#include "object.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_AVAILABLE
+#endif
+
+#define JIT_HOTNESS_THRESHOLD 1000
+
+// State shared between the interpreter and the native code.
+typedef struct {
+    Value* slots;
+    Value* stack_top;
+    Value* constants;
+    Value* globals;
+    ObjFunction* func;
+    ObjClosure* closure;
+} JitState;
+
+// Runs native code from the instruction at bytecode offset pc and returns
+// the offset of the instruction the interpreter has to continue with.
+typedef int (*JitEntry)(JitState* state, int pc);
+
+// Native code of a function, either compiled at runtime or linked into a
+// program translated with --emit-c (see aot.h).
+struct s_jit_code {
+    JitEntry entry;
+    void** entries; // Address of each instruction, by bytecode offset
+};
+
+void free_jit();
+void free_jit_code(JitCode* code);
+bool jit_compile(ObjFunction* func);
+
+// Counts one more call or back-edge of the function and compiles it when
+// it gets hot. Returns true if the function has native code.
+static inline bool jit_is_hot(ObjFunction* func) {
+    if (func->jit != NULL) {
+        return true;
+    }
+    if (++func->hotness < JIT_HOTNESS_THRESHOLD) {
+        return false;
+    }
+    return jit_compile(func);
+}
+
+static inline int jit_run(JitCode* code, JitState* state, int pc) {
+    return code->entry(state, pc);
+}
+
+#endif
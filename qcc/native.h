@@ -4,6 +4,12 @@
 #include "values.h"
 #include "type.h"
 
+// argv points into the VM stack, to the first of the argc arguments, in the
+// same order they were written in the call. Methods of native classes get
+// self as the last argument. argv is only valid during the call, and the
+// native can push up to NATIVE_STACK_RESERVE temporaries without moving it.
+#define NATIVE_STACK_RESERVE 8
+
 typedef Value (*native_fn_t) (int argc, Value* argv);
 
 typedef struct {
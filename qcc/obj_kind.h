@@ -5,13 +5,16 @@ typedef enum {
     OBJ_STRING,
     OBJ_FUNCTION,
     OBJ_BINDED_METHOD,
-    OBJ_CLOSED,
+    OBJ_UPVALUE,
+    OBJ_CLOSURE,
     OBJ_NATIVE,
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_ARRAY,
 } ObjKind;
 
+#define OBJ_KIND_COUNT (OBJ_ARRAY + 1)
+
 #define CLASS_CONSTRUCTOR_NAME "init"
 #define CLASS_CONSTRUCTOR_LENGTH 4
 #define CLASS_SELF_NAME "self"
@@ -5,6 +5,8 @@
 #include "table.h"
 #include "array.h"
 #include "string.h"
+#include "gc_threads.h"
+#include "heap.h"
 
 static Obj* alloc_obj(size_t size, ObjKind kind, Type* type);
 static ObjString* alloc_string(const char* chars, int length, uint32_t hash);
@@ -13,69 +15,68 @@ static ObjString* alloc_string(const char* chars, int length, uint32_t hash);
 #define ALLOC_STR(length) (ObjString*) alloc_obj(sizeof(ObjString) + sizeof(char) * length, OBJ_STRING, CREATE_TYPE_STRING())
 
 static Obj* alloc_obj(size_t size, ObjKind kind, Type* type) {
-    Obj* obj = (Obj*) qvm_realloc(NULL, 0, size);
+    Obj* obj = (Obj*) qvm_alloc_object(size);
+    qvm.gc_stats.objects_allocated[kind]++;
     obj->kind = kind;
     obj->type = type;
-    obj->is_marked = false;
-    obj->next = qvm.objects;
-    qvm.objects = obj;
     init_valuearray(&obj->props);
     return obj;
 }
 
 ObjFunction* new_function(const char* name, int length, int upvalues, Type* type) {
     ObjFunction* func = (ObjFunction*) alloc_obj(
-        sizeof(ObjFunction) + (sizeof(Upvalue) * upvalues),
+        sizeof(ObjFunction) + (sizeof(UpvalueInfo) * upvalues),
         OBJ_FUNCTION,
         type);
     init_chunk(&func->chunk);
     func->arity = 0;
+    func->local_count = 1;
+    func->max_stack = 1;
+    func->hotness = 0;
+    func->jit = NULL;
     func->name = copy_string(name, length);
     func->upvalue_count = upvalues;
     for (int i = 0; i < upvalues; i++) {
-        func->upvalues[i].is_closed = false;
+        func->upvalues[i].is_local = false;
+        func->upvalues[i].index = 0;
     }
     return func;
 }
 
-void function_close_upvalue(ObjFunction* const function, int upvalue, ObjClosed* closed) {
-    function->upvalues[upvalue].is_closed = true;
-    function->upvalues[upvalue].closed = closed;
+ObjUpvalue* new_upvalue(Value* location) {
+    ObjUpvalue* upvalue = ALLOC_OBJ(ObjUpvalue, OBJ_UPVALUE, CREATE_TYPE_UNKNOWN());
+    upvalue->location = location;
+    upvalue->closed = NIL_VALUE();
+    upvalue->next = NULL;
+    return upvalue;
 }
 
-void function_open_upvalue(ObjFunction* const function, int upvalue, Value* value) {
-    function->upvalues[upvalue].is_closed = false;
-    function->upvalues[upvalue].open = value;
-}
-
-Value* function_get_upvalue(ObjFunction* const function, int slot) {
-    Value* target;
-    if (function->upvalues[slot].is_closed) {
-        target = &function->upvalues[slot].closed->value;
-    } else {
-        target = function->upvalues[slot].open;
+// The upvalues start empty, so the GC can trace the closure while they
+// are captured.
+ObjClosure* new_closure(ObjFunction* function) {
+    ObjClosure* closure = (ObjClosure*) alloc_obj(
+        sizeof(ObjClosure) + (sizeof(ObjUpvalue*) * function->upvalue_count),
+        OBJ_CLOSURE,
+        function->obj.type);
+    closure->function = function;
+    closure->upvalue_count = function->upvalue_count;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        closure->upvalues[i] = NULL;
     }
-    return target;
+    return closure;
 }
 
 ObjArray* new_array(Type* inner) {
     assert(inner != NULL);
     Type* type = create_type_array(inner);
     ObjArray* arr = ALLOC_OBJ(ObjArray, OBJ_ARRAY, type);
-    stack_push(OBJ_VALUE(arr, type));
+    stack_push(OBJ_VALUE(arr));
     init_valuearray(&arr->elements);
     array_push_props(&arr->obj.props);
     stack_pop();
     return arr;
 }
 
-ObjClosed* new_closed(Value value) {
-    // TODO again, which type should be a ObjClosed (look vm.c too)
-    ObjClosed* closed = ALLOC_OBJ(ObjClosed, OBJ_CLOSED, CREATE_TYPE_UNKNOWN());
-    closed->value = value;
-    return closed;
-}
-
 ObjNative* new_native(const char* name, int length, native_fn_t function, Type* type) {
     ObjNative* native = ALLOC_OBJ(ObjNative, OBJ_NATIVE, type);
     native->name = name;
@@ -94,7 +95,7 @@ ObjClass* new_class(const char* name, int length, Type* type) {
 ObjInstance* new_instance(ObjClass* origin) {
     ObjInstance* instance = ALLOC_OBJ(ObjInstance, OBJ_INSTANCE, origin->obj.type);
     instance->klass = origin;
-    stack_push(OBJ_VALUE(instance, instance->obj.type));
+    stack_push(OBJ_VALUE(instance));
     valuearray_deep_copy(&origin->obj.props, &instance->obj.props);
     stack_pop();
     return instance;
@@ -114,6 +115,7 @@ Value object_get_property(Obj* obj, uint8_t index) {
 
 void object_set_property(Obj* obj, uint8_t index, Value val) {
     assert(index < obj->props.size);
+    qvm_write_barrier(obj, val);
     obj->props.values[index] = val;
 }
 
@@ -142,7 +144,7 @@ ObjString* copy_string(const char* chars, int length) {
         return interned;
     }
     ObjString* str = alloc_string(chars, length, hash);
-    stack_push(OBJ_VALUE(str, CREATE_TYPE_STRING())); // We need to GC discover our new string.
+    stack_push(OBJ_VALUE(str)); // We need to GC discover our new string.
     table_set(&qvm.strings, str, NIL_VALUE());
     string_push_props(&str->obj.props);
     stack_pop();
@@ -170,13 +172,17 @@ void print_object(Obj* const obj) {
         printf(">");
         break;
     }
-    case OBJ_CLOSED: {
-        ObjClosed* closed = OBJ_AS_CLOSED(obj);
-        printf("<Closed [");
-        value_print(closed->value);
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = OBJ_AS_UPVALUE(obj);
+        printf("<Upvalue [");
+        value_print(*upvalue->location);
         printf("]>");
         break;
     }
+    case OBJ_CLOSURE: {
+        print_object((Obj*) OBJ_AS_CLOSURE(obj)->function);
+        break;
+    }
     case OBJ_NATIVE: {
         ObjNative* native = OBJ_AS_NATIVE(obj);
         printf(
@@ -217,11 +223,43 @@ bool object_is_kind(Obj* const obj, ObjKind kind) {
     return obj->kind == kind;
 }
 
+// Bytes the object was allocated with. The collector uses it to copy
+// objects out of the nursery and to walk it.
+size_t object_size(Obj* const obj) {
+    switch (obj->kind) {
+    case OBJ_STRING:
+        return sizeof(ObjString) + OBJ_AS_STRING(obj)->length + 1;
+    case OBJ_FUNCTION:
+        return sizeof(ObjFunction) + sizeof(UpvalueInfo) * OBJ_AS_FUNCTION(obj)->upvalue_count;
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    case OBJ_CLOSURE:
+        return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * OBJ_AS_CLOSURE(obj)->upvalue_count;
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_CLASS:
+        return sizeof(ObjClass);
+    case OBJ_INSTANCE:
+        return sizeof(ObjInstance);
+    case OBJ_BINDED_METHOD:
+        return sizeof(ObjBindedMethod);
+    case OBJ_ARRAY:
+        return sizeof(ObjArray);
+    }
+    return 0;
+}
+
 void mark_object(Obj* const obj) {
     if (obj == NULL) {
         return;
     }
-    if (obj->is_marked) {
+    if (gc_worker != NULL) {
+        gc_worker_mark(gc_worker, obj);
+        return;
+    }
+    // Only old objects have a mark bit, in the side bitmap of their page
+    assert(! QVM_IS_YOUNG(obj));
+    if (heap_is_marked(obj)) {
         return;
     }
 #ifdef GC_DEBUG
@@ -229,6 +267,6 @@ void mark_object(Obj* const obj) {
     print_object(obj);
     printf("\n");
 #endif
-    obj->is_marked = true;
+    heap_set_mark(obj);
     qvm_push_gray(obj);
 }
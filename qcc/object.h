@@ -9,10 +9,13 @@
 
 typedef struct s_obj {
     ObjKind kind;
-    Type* type;
-    bool is_marked;
+    union {
+        Type* type;
+        struct s_obj* forward; // The copy of a young object that was moved
+    };
+    bool is_remembered; // In qvm.remembered (see qvm_write_barrier)
+    bool is_forwarded;
     ValueArray props;
-    struct s_obj* next;
 } Obj;
 
 typedef struct s_obj_string {
@@ -22,28 +25,47 @@ typedef struct s_obj_string {
     char chars[];
 } ObjString;
 
+// Where a closure takes each upvalue from when it is created: a slot of
+// the enclosing frame, or an upvalue of the enclosing closure.
 typedef struct {
+    bool is_local;
+    uint8_t index;
+} UpvalueInfo;
+
+// A captured variable. While open it points to the stack slot of the
+// variable, and it is kept in qvm.open_upvalues. Closing it moves the value
+// into closed, so every closure sharing it keeps seeing the same variable.
+typedef struct s_obj_upvalue {
     Obj obj;
-    Value value;
-} ObjClosed;
+    Value* location;
+    Value closed;
+    struct s_obj_upvalue* next; // Next open upvalue, lower in the stack
+} ObjUpvalue;
 
-typedef struct {
-    bool is_closed;
-    union {
-        Value* open;
-        ObjClosed* closed;
-    };
-} Upvalue;
+typedef struct s_jit_code JitCode;
 
 typedef struct {
     Obj obj;
     int arity;
     Chunk chunk;
     ObjString* name;
+    int local_count; // Slot 0, parameters and locals
+    int max_stack; // Slots a frame uses at most, locals included
+    int hotness; // Calls and back-edges, counted only with the JIT on
+    JitCode* jit; // Native code, or NULL
     int upvalue_count;
-    Upvalue upvalues[];
+    UpvalueInfo upvalues[];
 } ObjFunction;
 
+// Functions are immutable. The ones with upvalues are wrapped in a closure
+// each time their declaration runs (see OP_CLOSURE).
+typedef struct {
+    Obj obj;
+    ObjFunction* function;
+    int upvalue_count;
+    ObjUpvalue* upvalues[];
+} ObjClosure;
+
 typedef struct {
     Obj obj;
     const char* name;
@@ -77,6 +99,7 @@ typedef struct {
 
 void print_object(Obj* const obj);
 bool object_is_kind(Obj* const obj, ObjKind kind);
+size_t object_size(Obj* const obj);
 void mark_object(Obj* const obj);
 
 #define OBJ_IS_STRING(obj) (object_is_kind(obj, OBJ_STRING))
@@ -91,14 +114,16 @@ ObjString* concat_string(ObjString* first, ObjString* second);
 #define OBJ_AS_FUNCTION(obj) ((ObjFunction*) obj)
 
 ObjFunction* new_function(const char* name, int length, int upvalues, Type* type);
-void function_close_upvalue(ObjFunction* const function, int upvalue, ObjClosed* closed);
-void function_open_upvalue(ObjFunction* const function, int upvalue, Value* value);
-Value* function_get_upvalue(ObjFunction* const function, int slot);
 
-#define OBJ_IS_CLOSED(obj) (object_is_kind(obj, OBJ_CLOSED))
-#define OBJ_AS_CLOSED(obj) ((ObjClosed*) obj)
+#define OBJ_IS_UPVALUE(obj) (object_is_kind(obj, OBJ_UPVALUE))
+#define OBJ_AS_UPVALUE(obj) ((ObjUpvalue*) obj)
+
+ObjUpvalue* new_upvalue(Value* location);
+
+#define OBJ_IS_CLOSURE(obj) (object_is_kind(obj, OBJ_CLOSURE))
+#define OBJ_AS_CLOSURE(obj) ((ObjClosure*) obj)
 
-ObjClosed* new_closed(Value value);
+ObjClosure* new_closure(ObjFunction* function);
 
 #define OBJ_IS_NATIVE(obj) (object_is_kind(obj, OBJ_NATIVE))
 #define OBJ_AS_NATIVE(obj) ((ObjNative*) obj)
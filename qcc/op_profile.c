@@ -0,0 +1,133 @@
+#include "op_profile.h"
+
+#ifdef PROFILE_OPS
+
+#include <string.h>
+#include "debug.h" // for opcode_name
+
+OpProfile op_profile;
+
+typedef struct {
+    uint64_t count;
+    uint64_t ticks;
+    int first;
+    int second;
+} OpProfileEntry;
+
+static int compare_entries(const void* a, const void* b);
+static void print_opcodes(FILE* out);
+static void print_pairs(FILE* out);
+
+void init_op_profile(bool timing) {
+    memset(&op_profile, 0, sizeof(OpProfile));
+    op_profile.enabled = true;
+    op_profile.timing = timing;
+    op_profile.last = OP_PROFILE_NO_OPCODE;
+    op_profile.last_tick = op_profile_ticks();
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const OpProfileEntry* first = (const OpProfileEntry*) a;
+    const OpProfileEntry* second = (const OpProfileEntry*) b;
+    if (first->count == second->count) {
+        return 0;
+    }
+    return (first->count < second->count) ? 1 : -1;
+}
+
+void op_profile_print(FILE* out) {
+    print_opcodes(out);
+    print_pairs(out);
+}
+
+static void print_opcodes(FILE* out) {
+    OpProfileEntry entries[UINT8_COUNT];
+    int size = 0;
+    uint64_t total = 0;
+    uint64_t total_ticks = 0;
+    for (int op = 0; op < UINT8_COUNT; op++) {
+        if (op_profile.counts[op] == 0) {
+            continue;
+        }
+        entries[size++] = (OpProfileEntry){
+            .count = op_profile.counts[op],
+            .ticks = op_profile.ticks[op],
+            .first = op,
+        };
+        total += op_profile.counts[op];
+        total_ticks += op_profile.ticks[op];
+    }
+    qsort(entries, size, sizeof(OpProfileEntry), compare_entries);
+
+    fprintf(out, "--------[ OPCODES ]--------\n");
+    if (op_profile.timing) {
+        fprintf(out, "%14s %7s %16s %7s %10s  %s\n", "count", "%", OP_PROFILE_TICK_UNIT, "%", "per op", "opcode");
+    } else {
+        fprintf(out, "%14s %7s  %s\n", "count", "%", "opcode");
+    }
+    for (int i = 0; i < size; i++) {
+        OpProfileEntry* entry = &entries[i];
+        double percent = 100.0 * entry->count / total;
+        if (op_profile.timing) {
+            fprintf(
+                out,
+                "%14llu %6.2f%% %16llu %6.2f%% %10.1f  %s\n",
+                (unsigned long long) entry->count,
+                percent,
+                (unsigned long long) entry->ticks,
+                total_ticks == 0 ? 0.0 : 100.0 * entry->ticks / total_ticks,
+                (double) entry->ticks / entry->count,
+                opcode_name(entry->first));
+        } else {
+            fprintf(
+                out,
+                "%14llu %6.2f%%  %s\n",
+                (unsigned long long) entry->count,
+                percent,
+                opcode_name(entry->first));
+        }
+    }
+}
+
+static void print_pairs(FILE* out) {
+    int size = 0;
+    uint64_t total = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++) {
+            if (op_profile.pairs[first][second] > 0) {
+                size++;
+                total += op_profile.pairs[first][second];
+            }
+        }
+    }
+    OpProfileEntry* entries = (OpProfileEntry*) malloc(sizeof(OpProfileEntry) * (size + 1));
+    size = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++) {
+            if (op_profile.pairs[first][second] == 0) {
+                continue;
+            }
+            entries[size++] = (OpProfileEntry){
+                .count = op_profile.pairs[first][second],
+                .first = first,
+                .second = second,
+            };
+        }
+    }
+    qsort(entries, size, sizeof(OpProfileEntry), compare_entries);
+
+    fprintf(out, "--------[ OPCODE PAIRS ]--------\n");
+    fprintf(out, "%14s %7s  %s\n", "count", "%", "pair");
+    for (int i = 0; i < size; i++) {
+        fprintf(
+            out,
+            "%14llu %6.2f%%  %s -> %s\n",
+            (unsigned long long) entries[i].count,
+            100.0 * entries[i].count / total,
+            opcode_name(entries[i].first),
+            opcode_name(entries[i].second));
+    }
+    free(entries);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef QUARTZ_OP_PROFILE_H_
+#define QUARTZ_OP_PROFILE_H_
+
+// Opcode profiler used by --profile-ops. It only exists in builds with
+// PROFILE_OPS defined (make profile), so release builds do not pay for it.
+// Include this around a ifdef PROFILE_OPS / endif.
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define OP_PROFILE_TICK_UNIT "cycles"
+static inline uint64_t op_profile_ticks() {
+    return __rdtsc();
+}
+#else
+#include <time.h>
+#define OP_PROFILE_TICK_UNIT "ns"
+static inline uint64_t op_profile_ticks() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+#define OP_PROFILE_NO_OPCODE -1
+
+typedef struct {
+    bool enabled;
+    bool timing;
+    int last; // Last executed opcode or OP_PROFILE_NO_OPCODE
+    uint64_t last_tick;
+    uint64_t counts[UINT8_COUNT];
+    uint64_t ticks[UINT8_COUNT];
+    uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+} OpProfile;
+
+extern OpProfile op_profile;
+
+void init_op_profile(bool timing);
+void op_profile_print(FILE* out);
+
+// Called before each opcode is executed. The ticks elapsed since the
+// previous call are charged to the previous opcode.
+static inline void op_profile_count(uint8_t op) {
+    if (op_profile.last != OP_PROFILE_NO_OPCODE) {
+        op_profile.pairs[op_profile.last][op]++;
+        if (op_profile.timing) {
+            uint64_t now = op_profile_ticks();
+            op_profile.ticks[op_profile.last] += now - op_profile.last_tick;
+            op_profile.last_tick = now;
+        }
+    }
+    op_profile.counts[op]++;
+    op_profile.last = op;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#!/bin/bash
+# Builds the interpreter with opcode profiling, runs every program in
+# ./programs with --profile-ops and prints the executed opcode pairs of all
+# of them sorted by frequency.
+# Programs that do not finish in TIMEOUT seconds are left out.
+# Use: ./opfreq.sh [make variables, for example CC=gcc]
+
+REPORT=`mktemp`
+TIMEOUT=30
+
+make profile "$@" > /dev/null 2>&1 || exit 1
+for program in `find ./programs -name "*.qz"`; do
+    timeout $TIMEOUT ./quartz --profile-ops "$program" < /dev/null 2>&1 > /dev/null | grep " -> " >> $REPORT
+done
+
+awk '{ count[$3 " " $5] += $1; total += $1 }
+     END { for (pair in count) printf "%12d %6.2f%% %s\n", count[pair], 100 * count[pair] / total, pair }' $REPORT \
+    | sort -rn
+rm $REPORT
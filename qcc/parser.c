@@ -1060,6 +1060,8 @@ static Expr* binary(Parser* const parser, bool can_assign, Expr* left) {
         .left = left,
         .op = op,
         .right = right,
+        .left_type = NULL, // we dont know yet
+        .right_type = NULL,
     };
 
 #ifdef PARSER_DEBUG
@@ -0,0 +1,201 @@
+#include "profiler.h"
+
+#ifdef _WIN32
+
+bool init_profiler(int hz) {
+    return false;
+}
+
+void free_profiler() {}
+void profiler_stop() {}
+void profiler_write_folded(FILE* out) {}
+
+#else
+
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include "vm.h"
+
+// The signal handler cannot allocate, so equal stacks are folded in place
+// into a preallocated hash table. Its frames live in a preallocated pool.
+// When one of them is full, new stacks are counted as dropped.
+#define PROFILER_STACKS (1 << 14)
+#define PROFILER_FRAMES (1 << 18)
+
+typedef struct {
+    ObjFunction* func;
+    int line; // 0 when unknown
+} ProfilerFrame;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t samples;
+    int depth;
+    int first; // Index of the outermost frame in the pool
+} ProfilerStack;
+
+typedef struct {
+    ProfilerStack* stacks;
+    ProfilerFrame* frames;
+    int frames_used;
+    uint64_t samples;
+    uint64_t dropped;
+    bool running;
+} Profiler;
+
+static Profiler profiler;
+
+static void profiler_sample(int signum);
+static int frame_line(const CallFrame* frame);
+static void record_stack(const ProfilerFrame* sample, int depth, uint64_t hash);
+static bool same_frames(const ProfilerFrame* first, const ProfilerFrame* second, int depth);
+static void set_timer(int hz);
+
+bool init_profiler(int hz) {
+    profiler.stacks = (ProfilerStack*) calloc(PROFILER_STACKS, sizeof(ProfilerStack));
+    profiler.frames = (ProfilerFrame*) calloc(PROFILER_FRAMES, sizeof(ProfilerFrame));
+    if (profiler.stacks == NULL || profiler.frames == NULL) {
+        exit(1);
+    }
+    profiler.frames_used = 0;
+    profiler.samples = 0;
+    profiler.dropped = 0;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profiler_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        return false;
+    }
+    set_timer(hz);
+    profiler.running = true;
+    return true;
+}
+
+void free_profiler() {
+    profiler_stop();
+    free(profiler.stacks);
+    free(profiler.frames);
+    profiler.stacks = NULL;
+    profiler.frames = NULL;
+}
+
+void profiler_stop() {
+    if (! profiler.running) {
+        return;
+    }
+    set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    profiler.running = false;
+}
+
+static void set_timer(int hz) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = (hz == 0) ? 0 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Runs inside the signal handler: it only reads the frames and writes
+// into memory reserved by init_profiler. Frames are never reallocated in
+// place (see grow_frames), so qvm.frames is always valid here.
+static void profiler_sample(int signum) {
+    if (! qvm.is_running) {
+        return;
+    }
+    ProfilerFrame sample[PROFILER_MAX_DEPTH];
+    int count = qvm.frame_count;
+    int first = (count > PROFILER_MAX_DEPTH) ? count - PROFILER_MAX_DEPTH : 0;
+    int depth = 0;
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (int i = first; i < count; i++) {
+        const CallFrame* frame = &qvm.frames[i];
+        if (frame->func == NULL) {
+            continue;
+        }
+        // The pc of the running frame lives in a local of run(), so only
+        // the callers know their current line.
+        int line = (i == count - 1) ? 0 : frame_line(frame);
+        sample[depth++] = (ProfilerFrame){ .func = frame->func, .line = line };
+        hash = (hash ^ (uintptr_t) frame->func) * 1099511628211ULL;
+        hash = (hash ^ (uint64_t) line) * 1099511628211ULL;
+    }
+    if (depth > 0) {
+        record_stack(sample, depth, hash);
+    }
+}
+
+static int frame_line(const CallFrame* frame) {
+    const Chunk* chunk = &frame->func->chunk;
+    if (frame->pc == NULL || frame->pc <= chunk->code || frame->pc > chunk->code + chunk->size) {
+        return 0;
+    }
+    return chunk->lines[frame->pc - chunk->code - 1];
+}
+
+static void record_stack(const ProfilerFrame* sample, int depth, uint64_t hash) {
+    profiler.samples++;
+    for (int probe = 0; probe < PROFILER_STACKS; probe++) {
+        ProfilerStack* stack = &profiler.stacks[(hash + probe) & (PROFILER_STACKS - 1)];
+        if (stack->samples == 0) {
+            if (profiler.frames_used + depth > PROFILER_FRAMES) {
+                break;
+            }
+            stack->hash = hash;
+            stack->depth = depth;
+            stack->first = profiler.frames_used;
+            memcpy(&profiler.frames[stack->first], sample, sizeof(ProfilerFrame) * depth);
+            profiler.frames_used += depth;
+            stack->samples = 1;
+            return;
+        }
+        bool same = stack->hash == hash
+            && stack->depth == depth
+            && same_frames(&profiler.frames[stack->first], sample, depth);
+        if (same) {
+            stack->samples++;
+            return;
+        }
+    }
+    profiler.dropped++;
+}
+
+static bool same_frames(const ProfilerFrame* first, const ProfilerFrame* second, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (first[i].func != second[i].func || first[i].line != second[i].line) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void profiler_write_folded(FILE* out) {
+    for (int i = 0; i < PROFILER_STACKS; i++) {
+        const ProfilerStack* stack = &profiler.stacks[i];
+        if (stack->samples == 0) {
+            continue;
+        }
+        for (int j = 0; j < stack->depth; j++) {
+            const ProfilerFrame* frame = &profiler.frames[stack->first + j];
+            const ObjString* name = frame->func->name;
+            fprintf(out, "%s%.*s", (j == 0) ? "" : ";", name->length, name->chars);
+            if (frame->line > 0) {
+                fprintf(out, ":%d", frame->line);
+            }
+        }
+        fprintf(out, " %llu\n", (unsigned long long) stack->samples);
+    }
+    if (profiler.dropped > 0) {
+        fprintf(
+            stderr,
+            "Profiler: %llu of %llu samples dropped, too many different stacks\n",
+            (unsigned long long) profiler.dropped,
+            (unsigned long long) profiler.samples);
+    }
+}
+
+#endif
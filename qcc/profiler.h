@@ -0,0 +1,20 @@
+#ifndef QUARTZ_PROFILER_H_
+#define QUARTZ_PROFILER_H_
+
+// Sampling profiler for quartz code, enabled with --profile=<file>. A
+// SIGPROF timer walks qvm.frames every tick, so the interpreter itself
+// runs exactly the same code with or without profiling. Samples are
+// written as folded stacks, ready for flamegraph.pl.
+
+#include "common.h"
+
+#define PROFILER_DEFAULT_HZ 1000
+#define PROFILER_MAX_DEPTH 64
+
+// Starts sampling. Returns false if the platform has no SIGPROF timers.
+bool init_profiler(int hz);
+void free_profiler();
+void profiler_stop();
+void profiler_write_folded(FILE* out);
+
+#endif
@@ -4,12 +4,96 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "vm.h"
+#include "vm_memory.h"
 #include "import.h"
 
 #ifdef DEBUG
 #include "debug.h"
 #endif
 
+#include "profiler.h"
+#include "jit.h"
+#include "aot.h"
+
+#ifdef PROFILE_OPS
+#include "op_profile.h"
+#endif
+
+static int max_stack = STACK_LIMIT;
+static int max_frames = FRAMES_LIMIT;
+static const char* profile_path = NULL;
+static int profile_hz = PROFILER_DEFAULT_HZ;
+static bool jit = false;
+static bool emit_c = false;
+static int gc_pause = -1;
+static int gc_threads = 0;
+static int gc_overhead = 0;
+static int gc_heap_limit = 0;
+static bool gc_histogram = false;
+static bool gc_stats = false;
+
+#ifdef PROFILE_OPS
+static bool profile_ops = false;
+static bool profile_ops_timing = false;
+#endif
+
+static void configure_qvm() {
+    qvm.max_stack = max_stack;
+    qvm.max_frames = max_frames;
+    qvm.jit = jit;
+    if (gc_pause >= 0) {
+        qvm.gc_pause_budget = gc_pause;
+    }
+    if (gc_threads > 0) {
+        qvm.gc_threads = gc_threads;
+    }
+    if (gc_overhead > 0) {
+        qvm.gc_overhead = gc_overhead;
+    }
+    if (gc_heap_limit > 0) {
+        qvm.gc_heap_limit = (size_t) gc_heap_limit * 1024 * 1024;
+    }
+}
+
+static void write_profile() {
+    FILE* out = fopen(profile_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot write profile to '%s'\n", profile_path);
+        return;
+    }
+    profiler_write_folded(out);
+    fclose(out);
+}
+
+static void execute(ObjFunction* main_func) {
+    if (profile_path != NULL && ! init_profiler(profile_hz)) {
+        fprintf(stderr, "The sampling profiler is not available in this platform\n");
+        profile_path = NULL;
+    }
+#ifdef PROFILE_OPS
+    if (profile_ops) {
+        init_op_profile(profile_ops_timing);
+    }
+#endif
+    qvm_execute(main_func);
+    if (profile_path != NULL) {
+        profiler_stop();
+        write_profile();
+        free_profiler();
+    }
+#ifdef PROFILE_OPS
+    if (profile_ops) {
+        op_profile_print(stderr);
+    }
+#endif
+    if (gc_histogram) {
+        print_gc_pauses(stderr);
+    }
+    if (gc_stats) {
+        print_gc_stats(stderr);
+    }
+}
+
 int run(const char* file, int length) {
     init_module_system();
     Import main = import(file, length);
@@ -26,10 +110,13 @@ int run(const char* file, int length) {
     int exit_code = 0;
     ObjFunction* main_func;
     init_qvm();
-    if (compile(main.file, &main_func) == COMPILATION_OK) {
-        qvm_execute(main_func);
-    } else {
+    configure_qvm();
+    if (compile(main.file, &main_func) != COMPILATION_OK) {
         exit_code = EX_DATAERR;
+    } else if (emit_c) {
+        aot_emit_c(stdout, main_func);
+    } else {
+        execute(main_func);
     }
     free_qvm();
     free_module_system();
@@ -60,8 +147,9 @@ void repl() {
         }
         ctx.source = (char*)&input_buffer;
         init_qvm();
+        configure_qvm();
         if (compile(ctx, &main_func) == COMPILATION_OK) {
-            qvm_execute(main_func);
+            execute(main_func);
         }
         free_qvm();
         free_module_system();
@@ -69,10 +157,118 @@ void repl() {
 #undef BUFFER_SIZE
 }
 
+static bool parse_limit(const char* arg, const char* option, int* limit) {
+    int length = strlen(option);
+    if (strncmp(arg, option, length) != 0 || arg[length] != '=') {
+        return false;
+    }
+    *limit = atoi(&arg[length + 1]);
+    return *limit > 0;
+}
+
+static bool parse_profile_ops(const char* arg) {
+    bool timing = strcmp(arg, "--profile-ops=time") == 0;
+    if (strcmp(arg, "--profile-ops") != 0 && !timing) {
+        return false;
+    }
+#ifdef PROFILE_OPS
+    profile_ops = true;
+    profile_ops_timing = timing;
+    return true;
+#else
+    fprintf(stderr, "This quartz was built without opcode profiling. Build it with 'make profile'.\n");
+    return false;
+#endif
+}
+
+static bool parse_profile(const char* arg) {
+    const char* option = "--profile=";
+    int length = strlen(option);
+    if (strncmp(arg, option, length) != 0 || arg[length] == '\0') {
+        return false;
+    }
+    profile_path = &arg[length];
+    return true;
+}
+
+static bool parse_jit(const char* arg) {
+    if (strcmp(arg, "--jit") != 0) {
+        return false;
+    }
+#ifdef JIT_AVAILABLE
+    jit = true;
+    return true;
+#else
+    fprintf(stderr, "The JIT is only available for x86-64 Linux.\n");
+    return false;
+#endif
+}
+
+static bool parse_emit_c(const char* arg) {
+    if (strcmp(arg, "--emit-c") != 0) {
+        return false;
+    }
+    emit_c = true;
+    return true;
+}
+
+static bool parse_gc_pause(const char* arg) {
+    const char* option = "--gc-pause=";
+    int length = strlen(option);
+    if (strncmp(arg, option, length) != 0 || arg[length] == '\0') {
+        return false;
+    }
+    gc_pause = atoi(&arg[length]);
+    return gc_pause >= 0;
+}
+
+static bool parse_gc_histogram(const char* arg) {
+    if (strcmp(arg, "--gc-histogram") != 0) {
+        return false;
+    }
+    gc_histogram = true;
+    return true;
+}
+
+static bool parse_gc_overhead(const char* arg) {
+    return parse_limit(arg, "--gc-overhead", &gc_overhead) && gc_overhead < 100;
+}
+
+static bool parse_gc_stats(const char* arg) {
+    if (strcmp(arg, "--gc-stats") != 0) {
+        return false;
+    }
+    gc_stats = true;
+    return true;
+}
+
+static bool parse_option(const char* arg) {
+    return parse_limit(arg, "--max-stack", &max_stack)
+        || parse_limit(arg, "--max-frames", &max_frames)
+        || parse_limit(arg, "--profile-hz", &profile_hz)
+        || parse_limit(arg, "--gc-threads", &gc_threads)
+        || parse_limit(arg, "--gc-heap-limit", &gc_heap_limit)
+        || parse_gc_overhead(arg)
+        || parse_profile(arg)
+        || parse_jit(arg)
+        || parse_emit_c(arg)
+        || parse_gc_pause(arg)
+        || parse_gc_histogram(arg)
+        || parse_gc_stats(arg)
+        || parse_profile_ops(arg);
+}
+
 int main(int argc, char** argv) {
-    if (argc <= 1) {
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (! parse_option(argv[arg])) {
+            fprintf(stderr, "Usage: quartz [--max-stack=<values>] [--max-frames=<frames>] [--profile=<file>] [--profile-hz=<hz>] [--profile-ops[=time]] [--gc-pause=<us>] [--gc-threads=<n>] [--gc-overhead=<percent>] [--gc-heap-limit=<mb>] [--gc-histogram] [--gc-stats] [--jit] [--emit-c] [file]\n");
+            return EX_USAGE;
+        }
+    }
+    if (arg >= argc) {
         repl();
     }
-    int length = strlen(argv[1]);
-    return run(argv[1], length);
+    int length = strlen(argv[arg]);
+    return run(argv[arg], length);
 }
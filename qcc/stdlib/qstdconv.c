@@ -106,7 +106,7 @@ static Value stdconv_ntos(int argc, Value* argv) {
     char buffer[32];
     int length = sprintf(buffer, "%g", number);
     ObjString* str = copy_string(buffer, length);
-    return OBJ_VALUE(str, CREATE_TYPE_STRING());
+    return OBJ_VALUE(str);
 }
 
 static Value stdconv_btos(int argc, Value* argv) {
@@ -118,7 +118,7 @@ static Value stdconv_btos(int argc, Value* argv) {
     } else {
         str = copy_string("false", 5);
     }
-    return OBJ_VALUE(str, CREATE_TYPE_STRING());
+    return OBJ_VALUE(str);
 }
 
 static Value stdconv_sum(int argc, Value* argv) {
@@ -139,7 +139,7 @@ static Value stdconv_ston(int argc, Value* argv) {
 
 static Value stdconv_typeof(int argc, Value* argv) {
     assert(argc == 1);
-    type_fprint(stdout, argv[0].type);
+    type_fprint(stdout, value_type(argv[0]));
     printf("\n");
     return NIL_VALUE();
 }
@@ -155,5 +155,5 @@ static Value stdconv_parse_ascii(int argc, Value* argv) {
 
     ObjString* out = copy_string(buffer, in->elements.size);
     free(buffer);
-    return OBJ_VALUE(out, CREATE_TYPE_STRING());
+    return OBJ_VALUE(out);
 }
@@ -0,0 +1,81 @@
+#include "qstdgc.h"
+#include "../values.h"
+#include "../common.h"
+#include "../object.h"
+#include "../native.h"
+#include "../vm_memory.h"
+
+static Value stdgc_gc_collect(int argc, Value* argv);
+static Value stdgc_gc_stats(int argc, Value* argv);
+static Value stdgc_heap_size(int argc, Value* argv);
+
+void register_stdgc(CTable* table) {
+    Type* collect_type = create_type_function();
+    collect_type->function.return_type = CREATE_TYPE_VOID();
+    NativeFunction gc_collect = (NativeFunction) {
+        .name = "gc_collect",
+        .length = 10,
+        .function = stdgc_gc_collect,
+        .type = collect_type,
+    };
+
+    Type* stats_type = create_type_function();
+    stats_type->function.return_type = CREATE_TYPE_STRING();
+    NativeFunction gc_stats = (NativeFunction) {
+        .name = "gc_stats",
+        .length = 8,
+        .function = stdgc_gc_stats,
+        .type = stats_type,
+    };
+
+    Type* heap_size_type = create_type_function();
+    heap_size_type->function.return_type = CREATE_TYPE_NUMBER();
+    NativeFunction heap_size = (NativeFunction) {
+        .name = "heap_size",
+        .length = 9,
+        .function = stdgc_heap_size,
+        .type = heap_size_type,
+    };
+
+#define FN_LENGTH 3
+    static NativeFunction functions[FN_LENGTH];
+    functions[0] = gc_collect;
+    functions[1] = gc_stats;
+    functions[2] = heap_size;
+
+    NativeImport stdgc_import = (NativeImport) {
+        .name = "stdgc",
+        .length = 5,
+        .functions = functions,
+        .functions_length = FN_LENGTH,
+    };
+#undef FN_LENGTH
+    CTABLE_SET(
+        table,
+        create_ctable_key(stdgc_import.name, stdgc_import.length),
+        stdgc_import,
+        NativeImport);
+}
+
+// Natives keep raw pointers to objects the nursery collection moves, so
+// the collection runs at the next safepoint: the next call or loop.
+static Value stdgc_gc_collect(int argc, Value* argv) {
+    qvm_request_full_collection();
+    return NIL_VALUE();
+}
+
+static Value stdgc_gc_stats(int argc, Value* argv) {
+    size_t length = format_gc_stats(NULL, 0);
+    char* text = (char*) malloc(length + 1);
+    if (text == NULL) {
+        exit(1);
+    }
+    format_gc_stats(text, length + 1);
+    ObjString* str = copy_string(text, (int) length);
+    free(text);
+    return OBJ_VALUE(str);
+}
+
+static Value stdgc_heap_size(int argc, Value* argv) {
+    return NUMBER_VALUE((double) qvm_heap_size());
+}
@@ -0,0 +1,8 @@
+#ifndef QUARTZ_STDLIB_STDGC_H_
+#define QUARTZ_STDLIB_STDGC_H_
+
+#include "../ctable.h"
+
+void register_stdgc(CTable* table);
+
+#endif
@@ -87,7 +87,7 @@ static Value stdio_readstr(int argc, Value* argv) {
     scanf("%ms", &buffer);
     ObjString* str = copy_string(buffer, strlen(buffer));
     free(buffer);
-    return OBJ_VALUE(str, CREATE_TYPE_STRING());
+    return OBJ_VALUE(str);
 }
 
 static Value stdio_read_stdin(int argc, Value* argv) {
@@ -102,5 +102,5 @@ static Value stdio_read_stdin(int argc, Value* argv) {
 
     ObjString* contents = copy_string((char*) buffer.elements, buffer.size);
     free_vector(&buffer);
-    return OBJ_VALUE(contents, CREATE_TYPE_STRING());
+    return OBJ_VALUE(contents);
 }
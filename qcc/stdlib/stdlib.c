@@ -4,6 +4,7 @@
 #include "qstdio.h"
 #include "qstdconv.h"
 #include "qstdtime.h"
+#include "qstdgc.h"
 
 void populate_imports();
 void print_loaded_imports();
@@ -36,6 +37,7 @@ void populate_imports() {
     register_stdio(&stdlib_imports);
     register_stdconv(&stdlib_imports);
     register_stdtime(&stdlib_imports);
+    register_stdgc(&stdlib_imports);
 }
 
 void print_loaded_imports() {
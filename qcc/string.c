@@ -49,10 +49,10 @@ static Value string_get_char(int argc, Value* argv) {
     int index = (int) VALUE_AS_NUMBER(INDEX);
     if (index < 0 || index >= str->length) {
         runtime_error("index out of string bounds");
-        return OBJ_VALUE(copy_string("", 0), CREATE_TYPE_STRING());
+        return OBJ_VALUE(copy_string("", 0));
     }
     char c = str->chars[index];
-    return OBJ_VALUE(copy_string(&c, 1), CREATE_TYPE_STRING());
+    return OBJ_VALUE(copy_string(&c, 1));
 
 #undef INDEX
 #undef SELF
@@ -64,9 +64,8 @@ static Value string_to_ascii(int argc, Value* argv) {
 
     ObjString* str = OBJ_AS_STRING(VALUE_AS_OBJ(SELF));
     ObjArray* out = new_array(CREATE_TYPE_NUMBER());
-    Type* out_type = create_type_array(CREATE_TYPE_NUMBER());
 
-    stack_push(OBJ_VALUE(out, out_type));
+    stack_push(OBJ_VALUE(out));
     for (int i = 0; i < str->length; i++) {
         char c = str->chars[i];
         valuearray_write(
@@ -74,7 +73,7 @@ static Value string_to_ascii(int argc, Value* argv) {
             NUMBER_VALUE(c));
     }
     stack_pop();
-    return OBJ_VALUE(out, out_type);
+    return OBJ_VALUE(out);
 
 #undef SELF
 }
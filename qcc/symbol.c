@@ -67,6 +67,8 @@ static void create_function_symbol(Symbol* const symbol) {
     FunctionSymbol* fn_sym = &symbol->function;
     init_vector(&fn_sym->param_names, sizeof(Token));
     fn_sym->upvalues = create_symbol_set();
+    fn_sym->compiled = NULL;
+    fn_sym->reassigned = false;
 }
 
 void free_symbol(Symbol* const symbol) {
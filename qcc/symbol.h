@@ -46,6 +46,13 @@ typedef struct {
     // this function is closed over. Is mainly used to bind open upvalues to
     // those variables.
     struct s_symbol_set* upvalues;
+
+    // The ObjFunction of a function declaration, set by the compiler before
+    // its body is compiled. NULL for natives and function typed variables.
+    struct s_obj* compiled;
+    // Set by the typechecker when the name is assigned, so calls to it
+    // cannot be bound to compiled.
+    bool reassigned;
 } FunctionSymbol;
 
 typedef struct {
@@ -186,7 +193,7 @@ NativeClassStmt register_native_class(ScopedSymbolTable* const table, char* name
 } while (false)
 
 #define NATIVE_PUSH_PROP(props, native_obj) do {\
-valuearray_write(props, OBJ_VALUE(native_obj, native_obj->obj.type));\
+valuearray_write(props, OBJ_VALUE(native_obj));\
 } while (false)
 
 #endif
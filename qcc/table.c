@@ -9,6 +9,7 @@
 #include "table.h"
 #include <string.h>
 #include "vm_memory.h"
+#include "heap.h"
 
 #define LOAD_FACTOR 0.75
 
@@ -32,7 +33,7 @@ void free_table(Table* const table) {
     if (table->entries == NULL) {
         return;
     }
-    FREE_ARRAY(Entry, table->entries, table->size);
+    FREE_ARRAY(Entry, table->entries, table->capacity);
     init_table(table);
 }
 
@@ -141,6 +142,16 @@ bool table_delete(Table* const table, ObjString* key) {
     return true;
 }
 
+// Replaces the key from with to, a string with the same hash. The GC uses
+// it when it moves a string, so the entry stays where it is.
+void table_move_key(Table* const table, ObjString* from, ObjString* to) {
+    assert(from->hash == to->hash);
+    Entry* entry = find_entry(table, from);
+    if (entry != NULL) {
+        entry->key = to;
+    }
+}
+
 ObjString* table_find_string(Table* const table, const char* chars, int length, uint32_t hash) {
     if (table->size == 0) {
         return NULL;
@@ -184,8 +195,7 @@ void table_delete_white(Table* const table) {
             continue;
         }
         Entry* current = &table->entries[i];
-        Obj* key = (Obj*) current->key;
-        if (! key->is_marked) {
+        if (! heap_is_marked((Obj*) current->key)) {
             table_delete(table, current->key);
         }
     }
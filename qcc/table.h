@@ -24,6 +24,7 @@ void free_table(Table* const table);
 void table_set(Table* const table, ObjString* key, Value value);
 Value table_find(Table* const table, ObjString* key);
 bool table_delete(Table* const table, ObjString* key);
+void table_move_key(Table* const table, ObjString* from, ObjString* to);
 ObjString* table_find_string(Table* const table, const char* chars, int length, uint32_t hash);
 void mark_table(Table* const table);
 void table_delete_white(Table* const table);
@@ -48,11 +48,15 @@ sub clean_entry {
 
 my $prog_dir = "../programs";
 my $test_dir = "./cases";
-my $clox_bin = "../quartz";
+# "--jit" runs every program with the JIT on. Any other argument lists the
+# tests and programs found.
+my $jit = grep { $_ eq "--jit" } @ARGV;
+my @options = grep { $_ ne "--jit" } @ARGV;
+my $clox_bin = $jit ? "../quartz --jit" : "../quartz";
 
 my %prog = read_files_as_hash($prog_dir);
 my %tests = read_files_as_hash($test_dir);
-if($ARGV[0]) {
+if($options[0]) {
 	print "\n======================\n";
 	print "Loaded tests:\n";
 	print map { "$_ => $tests{$_}\n" } keys %tests;
@@ -65,6 +69,15 @@ if($ARGV[0]) {
 my $have_err = 0;
 my $test_number = 0;
 
+# A program may have "// args: <options>" and "// env: <VAR=value>" lines
+# with the options and the environment it runs with.
+sub run_command {
+	my $text = read_text($_[0]);
+	my $env = ($text =~ m{^// env: (.*)$}m) ? "$1 " : "";
+	my $args = ($text =~ m{^// args: (.*)$}m) ? " $1" : "";
+	return "$env$clox_bin$args $_[0]";
+}
+
 sub print_ok {
 	print color('bold green');
 	print "OK\n";
@@ -82,7 +95,8 @@ sub print_error {
 while(my ($key, $value) = each(%tests)) {
 	if($prog{$key}) {
 		print("RUNNING TEST: $key... ");
-		my $result = `$clox_bin $prog{$key} 2>&1`;
+		my $command = run_command($prog{$key});
+		my $result = `$command 2>&1`;
 		if(!$result) {
 			$result = '';
 		}
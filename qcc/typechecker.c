@@ -413,6 +413,9 @@ static void typecheck_assignment(void* ctx, AssignmentExpr* assignment) {
     }
 
     check_and_mark_upvalue(checker, symbol);
+    if (symbol->kind == SYMBOL_FUNCTION) {
+        symbol->function.reassigned = true;
+    }
 
     checker->last_type = symbol->type;
     checker->last_token = assignment->name;
@@ -726,11 +729,21 @@ static void check_and_mark_upvalue(Typechecker* const checker, Symbol* var) {
 #ifdef TYPECHECKER_DEBUG
     printf("Yes\n");
 #endif
-    FuncMeta* meta = function_stack_peek(checker);
-    Symbol* fn_sym = lookup_with_class_str(checker, meta->name.start, meta->name.length);
-    assert(fn_sym != NULL);
-    assert(fn_sym->kind == SYMBOL_FUNCTION);
-    scoped_symbol_upvalue(checker->symbols, fn_sym, var);
+    // Every function between the one that uses the variable and the one
+    // that declares it captures it too, so the closures can pass it down.
+    FuncMeta* metas = VECTOR_AS_FUNC_META(&checker->function_stack);
+    int current = checker->function_stack.size - 1;
+    int scope_distance = 0;
+    for (int i = current; i >= 0; i--) {
+        scope_distance += metas[i].scope_distance;
+        if (i < current && lookup_levels(checker, var->name, scope_distance - 1) != NULL) {
+            break;
+        }
+        Symbol* fn_sym = lookup_with_class_str(checker, metas[i].name.start, metas[i].name.length);
+        assert(fn_sym != NULL);
+        assert(fn_sym->kind == SYMBOL_FUNCTION);
+        scoped_symbol_upvalue(checker->symbols, fn_sym, var);
+    }
 }
 
 static bool var_is_current_function_local(Typechecker* const checker, Symbol* var) {
@@ -944,6 +957,11 @@ static void typecheck_binary(void* ctx, BinaryExpr* binary) {
     ACCEPT_EXPR(checker, binary->right);
     Type* right_type = checker->last_type;
 
+    // Now we do know which types are. The compiler uses them to emit
+    // specialized opcodes.
+    binary->left_type = left_type;
+    binary->right_type = right_type;
+
 #define ERROR(msg)\
     have_error(checker);\
     PRINT_FILE_LINE_ERR(&binary->op);\
@@ -62,7 +62,7 @@ static void should_emit_binary() {
     ASSERT_CHUNK("2+2;", {
         emit_constant(&my, NUMBER_VALUE(2), 1);
         emit_constant(&my, NUMBER_VALUE(2), 1);
-        chunk_write(&my, OP_ADD, 1);
+        chunk_write(&my, OP_ADD_NUM, 1);
         chunk_write(&my, OP_POP, 1);
     });
 }
@@ -71,7 +71,7 @@ static void should_emit_complex_calc() {
     ASSERT_CHUNK("(5+4)*2;", {
         emit_constant(&my, NUMBER_VALUE(5), 1);
         emit_constant(&my, NUMBER_VALUE(4), 1);
-        chunk_write(&my, OP_ADD, 1);
+        chunk_write(&my, OP_ADD_NUM, 1);
         emit_constant(&my, NUMBER_VALUE(2), 1);
         chunk_write(&my, OP_MUL, 1);
         chunk_write(&my, OP_POP, 1);
@@ -82,35 +82,58 @@ static void should_emit_comparisions() {
     ASSERT_CHUNK("1 == 2;", {
         emit_constant(&my, NUMBER_VALUE(1), 1);
         emit_constant(&my, NUMBER_VALUE(2), 1);
-        chunk_write(&my, OP_EQUAL, 1);
+        chunk_write(&my, OP_EQUAL_NUM, 1);
         chunk_write(&my, OP_POP, 1);
     });
+    ASSERT_CHUNK("1 <= 2;", {
+        emit_constant(&my, NUMBER_VALUE(1), 1);
+        emit_constant(&my, NUMBER_VALUE(2), 1);
+        chunk_write(&my, OP_LOWER_EQUAL, 1);
+        chunk_write(&my, OP_POP, 1);
+    });
+    ASSERT_CHUNK("1 != 2;", {
+        emit_constant(&my, NUMBER_VALUE(1), 1);
+        emit_constant(&my, NUMBER_VALUE(2), 1);
+        chunk_write(&my, OP_NOT_EQUAL_NUM, 1);
+        chunk_write(&my, OP_POP, 1);
+    });
+}
+
+static void should_emit_fused_loop_jumps() {
+    ASSERT_CHUNK("while (1 < 2) {}", {
+        emit_constant(&my, NUMBER_VALUE(1), 1);
+        emit_constant(&my, NUMBER_VALUE(2), 1);
+        chunk_write(&my, OP_JUMP_IF_NOT_LOWER, 1);
+        chunk_write(&my, 0, 1);
+        chunk_write(&my, 3, 1); // Skips the OP_LOOP
+        chunk_write(&my, OP_LOOP, 1);
+        chunk_write(&my, 0, 1);
+        chunk_write(&my, 10, 1); // Back to the first constant
+    });
 }
 
 static void should_compile_globals() {
     ASSERT_CHUNK("var esto = 5*2;", {
-        uint8_t index = valuearray_write(&my.constants, OBJ_VALUE(copy_string("esto", 4), CREATE_TYPE_STRING()));
         emit_constant(&my, NUMBER_VALUE(5), 1);
         emit_constant(&my, NUMBER_VALUE(2), 1);
         chunk_write(&my, OP_MUL, 1);
         chunk_write(&my, OP_DEFINE_GLOBAL, 1);
-        chunk_write(&my, index, 1);
+        chunk_write(&my, 0, 1); // First global slot
     });
 }
 
 static void should_compile_globals_with_default_values() {
 #define DEFAULT_VALUE(code, default_val) do {\
     ASSERT_CHUNK(code, {\
-        uint8_t index = valuearray_write(&my.constants, OBJ_VALUE(copy_string("esto", 4), CREATE_TYPE_STRING()));\
         emit_constant(&my, default_val, 1);\
         chunk_write(&my, OP_DEFINE_GLOBAL, 1);\
-        chunk_write(&my, index, 1);\
+        chunk_write(&my, 0, 1);\
     });\
 } while(false)
 
     DEFAULT_VALUE("var esto: Number;", NUMBER_VALUE(0));
     DEFAULT_VALUE("var esto: Bool;", BOOL_VALUE(false));
-    DEFAULT_VALUE("var esto: String;", OBJ_VALUE(copy_string("", 0), CREATE_TYPE_STRING()));
+    DEFAULT_VALUE("var esto: String;", OBJ_VALUE(copy_string("", 0)));
 
 #undef DEFAULT_VALUE
 }
@@ -123,7 +146,8 @@ int main(void) {
         cmocka_unit_test(should_compile_globals),
         cmocka_unit_test(should_emit_binary),
         cmocka_unit_test(should_emit_complex_calc),
-        cmocka_unit_test(should_emit_comparisions)
+        cmocka_unit_test(should_emit_comparisions),
+        cmocka_unit_test(should_emit_fused_loop_jumps)
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
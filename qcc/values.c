@@ -9,11 +9,14 @@
 static bool is_truthy(Value value);
 
 void value_print(Value val) {
-    switch (val.kind) {
-    case VALUE_NUMBER: printf("%g", VALUE_AS_NUMBER(val)); break;
-    case VALUE_BOOL: printf("%s", VALUE_AS_BOOL(val) ? "true" : "false"); break;
-    case VALUE_NIL: printf("nil"); break;
-    case VALUE_OBJ: print_object(VALUE_AS_OBJ(val)); break;
+    if (VALUE_IS_NUMBER(val)) {
+        printf("%g", VALUE_AS_NUMBER(val));
+    } else if (VALUE_IS_BOOL(val)) {
+        printf("%s", VALUE_AS_BOOL(val) ? "true" : "false");
+    } else if (VALUE_IS_NIL(val)) {
+        printf("nil");
+    } else {
+        print_object(VALUE_AS_OBJ(val));
     }
 }
 
@@ -23,7 +26,7 @@ Value value_default(Type* type) {
     case TYPE_NUMBER: return NUMBER_VALUE(0);
     case TYPE_BOOL: return BOOL_VALUE(false);
     case TYPE_STRING: {
-        Value str = OBJ_VALUE(copy_string("", 0), CREATE_TYPE_STRING());
+        Value str = OBJ_VALUE(copy_string("", 0));
         return str;
     }
     default:
@@ -38,29 +41,12 @@ void mark_value(Value value) {
 }
 
 bool value_equals(Value first, Value second) {
-    switch (first.kind) {
-    case VALUE_NUMBER: {
-        if (!VALUE_IS_NUMBER(second)) {
-            return false;
-        }
-        return VALUE_AS_NUMBER(first) == VALUE_AS_NUMBER(second);
+    // Numbers are compared as doubles, so NaN is not equal to itself and
+    // 0 equals -0. The rest are equal only if they are the same word.
+    if (VALUE_IS_NUMBER(first)) {
+        return VALUE_IS_NUMBER(second) && VALUE_AS_NUMBER(first) == VALUE_AS_NUMBER(second);
     }
-    case VALUE_BOOL: {
-        if (!VALUE_IS_BOOL(second)) {
-            return false;
-        }
-        return VALUE_AS_BOOL(first) == VALUE_AS_BOOL(second);
-    }
-    case VALUE_NIL:
-        return VALUE_IS_NIL(second);
-    case VALUE_OBJ: {
-        if (!VALUE_IS_OBJ(second)) {
-            return false;
-        }
-        return VALUE_AS_OBJ(first) == VALUE_AS_OBJ(second);
-    }
-    }
-    assert(false); // We should not reach this line
+    return first == second;
 }
 
 void init_valuearray(ValueArray* const arr) {
@@ -73,7 +59,7 @@ void free_valuearray(ValueArray* const arr) {
     if (arr->values == NULL) {
         return;
     }
-    FREE(Value, arr->values);
+    FREE_ARRAY(Value, arr->values, arr->capacity);
     arr->size = 0;
     arr->capacity = 0;
 }
@@ -116,41 +102,33 @@ static bool is_truthy(Value value) {
     return ! VALUE_IS_NIL(value);
 }
 
-static Type* inspect_value_type(Value value) {
-    switch (value.kind) {
-    case VALUE_NUMBER: CREATE_TYPE_NUMBER();
-    case VALUE_BOOL: CREATE_TYPE_BOOL();
-    case VALUE_NIL: CREATE_TYPE_NIL();
-    case VALUE_OBJ: return VALUE_AS_OBJ(value)->type;
+Type* value_type(Value value) {
+    if (VALUE_IS_NUMBER(value)) {
+        return CREATE_TYPE_NUMBER();
+    }
+    if (VALUE_IS_BOOL(value)) {
+        return CREATE_TYPE_BOOL();
     }
+    if (VALUE_IS_NIL(value)) {
+        return CREATE_TYPE_NIL();
+    }
+    return VALUE_AS_OBJ(value)->type;
 }
 
 Value value_cast(Value value, Type* cast) {
-    if (TYPE_IS_ASSIGNABLE(cast, value.type)) {
+    Type* type = value_type(value);
+    if (TYPE_IS_ASSIGNABLE(cast, type)) {
         return value;
     }
     if (TYPE_IS_BOOL(cast)) {
         return BOOL_VALUE(is_truthy(value));
     }
-    if (TYPE_IS_ANY(value.type)) {
-        Type* inspected_type = inspect_value_type(value);
-        if (! TYPE_IS_ASSIGNABLE(cast, inspected_type)) {
-            runtime_error("Cast error!");
-            fprintf(stderr, "Cannot cast from 'Any' to '");
-            ERR_TYPE_PRINT(cast);
-            fprintf(stderr, "'. The real value for type is '");
-            ERR_TYPE_PRINT(inspected_type);
-            fprintf(stderr, "'.\n");
-            return value;
-        }
-        value.type = inspected_type;
-        return value;
-    }
-    runtime_error("Cast error!");
+    // runtime_error does not return while the program runs
     fprintf(stderr, "Cannot cast from '");
-    ERR_TYPE_PRINT(value.type);
+    ERR_TYPE_PRINT(type);
     fprintf(stderr, "' to '");
     ERR_TYPE_PRINT(cast);
     fprintf(stderr, "'.\n");
+    runtime_error("Cast error!");
     return value;
 }
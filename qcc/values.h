@@ -7,42 +7,63 @@
 typedef struct s_obj Obj;
 typedef struct s_obj_string ObjString;
 
-typedef enum {
-    VALUE_NUMBER,
-    VALUE_BOOL,
-    VALUE_NIL,
-    VALUE_OBJ,
-} ValueKind;
+// A Value is one 64-bit word (NaN-boxing). Numbers are stored as plain
+// doubles. Everything else is hidden in the payload of a quiet NaN that
+// arithmetic never produces: nil and the booleans as small tags, and
+// objects as pointers with the sign bit set. Values carry no type of their
+// own: the runtime type of an object is in its header (see value_type).
+typedef uint64_t Value;
 
-typedef struct {
-    Type* type;
-    ValueKind kind;
-    union {
-        double number;
-        bool boolean;
-        Obj* object;
-    } as;
-} Value;
+#define VALUE_SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define VALUE_QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define VALUE_TAG_NIL 1
+#define VALUE_TAG_FALSE 2
+#define VALUE_TAG_TRUE 3
+
+#define VALUE_NIL_BITS (VALUE_QNAN | VALUE_TAG_NIL)
+#define VALUE_FALSE_BITS (VALUE_QNAN | VALUE_TAG_FALSE)
+#define VALUE_TRUE_BITS (VALUE_QNAN | VALUE_TAG_TRUE)
+
+typedef union {
+    Value bits;
+    double number;
+} ValueBits;
+
+static inline Value value_from_number(double number) {
+    ValueBits value = { .number = number };
+    return value.bits;
+}
+
+static inline double value_to_number(Value bits) {
+    ValueBits value = { .bits = bits };
+    return value.number;
+}
 
 void value_print(Value val);
 bool value_equals(Value first, Value second);
 Value value_default(Type* type);
 Value value_cast(Value value, Type* cast);
+Type* value_type(Value value);
 void mark_value(Value value);
 
-#define NUMBER_VALUE(i) ((Value){ CREATE_TYPE_NUMBER(), VALUE_NUMBER, { .number = i } })
-#define BOOL_VALUE(b) ((Value){ CREATE_TYPE_BOOL(), VALUE_BOOL, { .boolean = b } })
-#define NIL_VALUE() ((Value){ CREATE_TYPE_NIL(), VALUE_NIL, { .object = NULL } })
-#define OBJ_VALUE(ob, obj_type) ((Value){ obj_type, VALUE_OBJ, { .object = (Obj*) ob } })
+#define NUMBER_VALUE(i) (value_from_number(i))
+#define BOOL_VALUE(b) ((b) ? VALUE_TRUE_BITS : VALUE_FALSE_BITS)
+#define NIL_VALUE() ((Value) VALUE_NIL_BITS)
+#define OBJ_VALUE(ob) ((Value) (VALUE_SIGN_BIT | VALUE_QNAN | (uint64_t) (uintptr_t) (ob)))
+
+#define VALUE_IS_NUMBER(val) (((val) & VALUE_QNAN) != VALUE_QNAN)
+#define VALUE_IS_BOOL(val) (((val) | 1) == VALUE_TRUE_BITS)
+#define VALUE_IS_NIL(val) ((val) == VALUE_NIL_BITS)
+#define VALUE_IS_OBJ(val) (((val) & (VALUE_QNAN | VALUE_SIGN_BIT)) == (VALUE_QNAN | VALUE_SIGN_BIT))
 
-#define VALUE_IS_NUMBER(val) (val.kind == VALUE_NUMBER)
-#define VALUE_IS_BOOL(val) (val.kind == VALUE_BOOL)
-#define VALUE_IS_NIL(val) (val.kind == VALUE_NIL)
-#define VALUE_IS_OBJ(val) (val.kind == VALUE_OBJ)
+#define VALUE_AS_NUMBER(val) value_to_number(val)
+#define VALUE_AS_BOOL(val) ((val) == VALUE_TRUE_BITS)
+#define VALUE_AS_OBJ(val) ((Obj*) (uintptr_t) ((val) & ~(VALUE_SIGN_BIT | VALUE_QNAN)))
 
-#define VALUE_AS_NUMBER(val) val.as.number
-#define VALUE_AS_BOOL(val) val.as.boolean
-#define VALUE_AS_OBJ(val) ((Obj*) val.as.object)
+// Whether two values have the same bits: the same object, or both nil.
+// No object has the bits of nil, so references compare this way.
+#define VALUE_SAME(a, b) ((a) == (b))
 
 typedef struct {
     int size;
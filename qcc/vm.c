@@ -1,4 +1,5 @@
 #include "vm.h"
+#include <string.h>
 #include "values.h"
 #include "math.h"
 #include "vm_memory.h"
@@ -6,21 +7,38 @@
 #include "stdlib/stdlib.h" // to init and free stdlib
 #include "array.h"
 #include "string.h"
+#include "jit.h"
+#include "gc_threads.h"
+#include "heap.h"
 
 #ifdef VM_DEBUG
 #include "debug.h"
 #endif
 
+#ifdef PROFILE_OPS
+#include "op_profile.h"
+#endif
+
 QVM qvm;
 
 static void init_gray_stack();
 static void free_gray_stack();
+static void init_nursery();
+static void free_nursery();
+static void init_gc_pacing();
+static void init_stacks();
+static void free_stacks();
+static void grow_stack(int needed);
+static void grow_frames();
 void runtime_error(const char* message);
+static inline void enter_frame(ObjFunction* fn, ObjClosure* closure, Value* slots, Value* result);
 static inline void call_native(ObjNative* native, uint8_t param_count);
 static inline void call_function(Obj* obj, Value* slots, uint8_t param_count);
 static inline void call(uint8_t param_count);
+static inline void call_direct(ObjFunction* fn, uint8_t param_count);
 static inline void invoke(uint8_t prop_index, uint8_t param_count);
 static inline Value stack_peek(uint8_t distance);
+static ObjUpvalue* capture_upvalue(Value* local);
 
 static void init_gray_stack() {
     qvm.gray_stack = NULL;
@@ -34,37 +52,227 @@ static void free_gray_stack() {
     }
 }
 
+static void init_nursery() {
+    qvm.nursery = (uint8_t*) malloc(NURSERY_SIZE);
+    if (qvm.nursery == NULL) {
+        exit(1);
+    }
+    qvm.nursery_top = qvm.nursery;
+    qvm.remembered = NULL;
+    qvm.remembered_capacity = 0;
+    qvm.remembered_size = 0;
+}
+
+static void free_nursery() {
+    free(qvm.nursery);
+    free(qvm.remembered);
+}
+
+static void init_gc_pacing() {
+    qvm.gc_state = GC_IDLE;
+    qvm.gc_allocated = 0;
+    qvm.gc_debt = 0;
+    const char* pause = getenv(GC_PAUSE_ENV);
+    qvm.gc_pause_budget = (pause != NULL) ? atoi(pause) : GC_DEFAULT_PAUSE;
+    if (qvm.gc_pause_budget < 0) {
+        qvm.gc_pause_budget = 0;
+    }
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        qvm.gc_pauses[i] = 0;
+    }
+    qvm.gc_max_pause = 0;
+    const char* overhead = getenv(GC_OVERHEAD_ENV);
+    qvm.gc_overhead = (overhead != NULL) ? atoi(overhead) : GC_DEFAULT_OVERHEAD;
+    if (qvm.gc_overhead < 1 || qvm.gc_overhead > 99) {
+        qvm.gc_overhead = GC_DEFAULT_OVERHEAD;
+    }
+    const char* limit = getenv(GC_HEAP_LIMIT_ENV);
+    qvm.gc_heap_limit = (limit != NULL && atoi(limit) > 0) ? (size_t) atoi(limit) * 1024 * 1024 : 0;
+    memset(&qvm.gc_stats, 0, sizeof(qvm.gc_stats));
+    const char* threads = getenv(GC_THREADS_ENV);
+    qvm.gc_threads = (threads != NULL) ? atoi(threads) : gc_default_threads();
+    if (qvm.gc_threads < 1) {
+        qvm.gc_threads = 1;
+    }
+}
+
+static void init_stacks() {
+    qvm.stack = (Value*) malloc(sizeof(Value) * STACK_INITIAL);
+    qvm.frames = (CallFrame*) calloc(FRAMES_INITIAL, sizeof(CallFrame));
+    if (qvm.stack == NULL || qvm.frames == NULL) {
+        exit(1);
+    }
+    qvm.stack_top = qvm.stack;
+    qvm.stack_capacity = STACK_INITIAL;
+    qvm.max_stack = STACK_LIMIT;
+    qvm.frame_count = 0;
+    qvm.frame_capacity = FRAMES_INITIAL;
+    qvm.max_frames = FRAMES_LIMIT;
+}
+
+static void free_stacks() {
+    free(qvm.stack);
+    free(qvm.frames);
+}
+
+// Grows the stack to hold at least needed values. Moving it leaves
+// dangling every pointer into it: the stack top, the slots of each frame
+// and the upvalues that are still open. They are moved to the new stack
+// before the old one is freed, as a pointer into freed memory can not
+// even be read.
+static void grow_stack(int needed) {
+    if (needed > qvm.max_stack) {
+        runtime_error("Stack overflow");
+        return;
+    }
+    int capacity = qvm.stack_capacity;
+    while (capacity < needed) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    if (capacity > qvm.max_stack) {
+        capacity = qvm.max_stack;
+    }
+    Value* stack = (Value*) malloc(sizeof(Value) * capacity);
+    if (stack == NULL) {
+        exit(1);
+    }
+    memcpy(stack, qvm.stack, sizeof(Value) * qvm.stack_capacity);
+#define RELOCATE(ptr) ((ptr) = stack + ((ptr) - qvm.stack))
+    RELOCATE(qvm.stack_top);
+    for (int i = 0; i < qvm.frame_count; i++) {
+        RELOCATE(qvm.frames[i].slots);
+        RELOCATE(qvm.frames[i].result);
+    }
+    for (ObjUpvalue* upvalue = qvm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        RELOCATE(upvalue->location);
+    }
+#undef RELOCATE
+    free(qvm.stack);
+    qvm.stack = stack;
+    qvm.stack_capacity = capacity;
+}
+
+static void grow_frames() {
+    if (qvm.frame_capacity >= qvm.max_frames) {
+        runtime_error("Frame overflow");
+        return;
+    }
+    int capacity = GROW_CAPACITY(qvm.frame_capacity);
+    if (capacity > qvm.max_frames) {
+        capacity = qvm.max_frames;
+    }
+    // The profiler reads the frames from a signal handler, so they are
+    // copied instead of reallocated: qvm.frames is valid at any moment and
+    // unused frames have no function.
+    CallFrame* frames = (CallFrame*) calloc(capacity, sizeof(CallFrame));
+    if (frames == NULL) {
+        exit(1);
+    }
+    memcpy(frames, qvm.frames, sizeof(CallFrame) * qvm.frame_capacity);
+    CallFrame* old_frames = qvm.frames;
+    qvm.frames = frames;
+    free(old_frames);
+    qvm.frame_capacity = capacity;
+    qvm.frame = &qvm.frames[qvm.frame_count - 1];
+}
+
 void init_qvm() {
+    init_heap();
     init_type_pool();
     init_stdlib();
 
     init_table(&qvm.strings);
-    init_table(&qvm.globals);
+    init_valuearray(&qvm.globals);
 
-    qvm.stack_top = qvm.stack;
-    qvm.objects = NULL;
+    init_stacks();
+    qvm.open_upvalues = NULL;
 
     init_string();
     init_array();
 
     init_gray_stack();
-
-    qvm.frame_count = 0;
+    init_nursery();
 
     qvm.is_running = false;
     qvm.had_runtime_error = false;
+    qvm.jit = false;
 
     qvm.bytes_allocated = 0;
-    qvm.next_gc_trigger = 2048;
+    qvm.gc_requested = false;
+    qvm.gc_full_requested = false;
+    init_gc_pacing();
+    init_gc_pacer();
 }
 
 void free_qvm() {
     free_stdlib();
     free_type_pool();
     free_table(&qvm.strings);
-    free_table(&qvm.globals);
+    free_valuearray(&qvm.globals);
     free_objects();
+    free_gc_threads();
     free_gray_stack();
+    free_nursery();
+    free_stacks();
+    free_jit();
+}
+
+// Globals live in a dense array. The compiler asks for a slot for each
+// global it declares, and the bytecode reads and writes them by index.
+int qvm_new_global() {
+    return valuearray_write(&qvm.globals, NIL_VALUE());
+}
+
+// Creates a closure of function for the running frame and leaves it on top
+// of the stack. Upvalues are captured after the push, which can move the
+// stack, and while the closure is reachable from it.
+void qvm_push_closure(ObjFunction* function) {
+    ObjClosure* closure = new_closure(function);
+    stack_push(OBJ_VALUE(closure));
+    CallFrame* frame = qvm.frame;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        UpvalueInfo* info = &function->upvalues[i];
+        if (info->is_local) {
+            closure->upvalues[i] = capture_upvalue(&frame->slots[info->index]);
+        } else {
+            assert(frame->closure != NULL);
+            closure->upvalues[i] = frame->closure->upvalues[info->index];
+        }
+    }
+}
+
+// Every closure capturing the same slot shares one upvalue, so the open
+// ones are looked up in qvm.open_upvalues before creating a new one.
+static ObjUpvalue* capture_upvalue(Value* local) {
+    ObjUpvalue* prev = NULL;
+    ObjUpvalue* upvalue = qvm.open_upvalues;
+    while (upvalue != NULL && upvalue->location > local) {
+        prev = upvalue;
+        upvalue = upvalue->next;
+    }
+    if (upvalue != NULL && upvalue->location == local) {
+        return upvalue;
+    }
+
+    ObjUpvalue* created = new_upvalue(local);
+    created->next = upvalue;
+    if (prev == NULL) {
+        qvm.open_upvalues = created;
+    } else {
+        prev->next = created;
+    }
+    return created;
+}
+
+// Closes the open upvalues of the slots from last to the stack top.
+void qvm_close_upvalues(Value* last) {
+    while (qvm.open_upvalues != NULL && qvm.open_upvalues->location >= last) {
+        ObjUpvalue* upvalue = qvm.open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        qvm_write_barrier((Obj*) upvalue, upvalue->closed);
+        qvm.open_upvalues = upvalue->next;
+    }
 }
 
 void qvm_push_gray(Obj* obj) {
@@ -84,59 +292,84 @@ Obj* qvm_pop_gray() {
     return qvm.gray_stack[--qvm.gray_stack_size];
 }
 
+void qvm_remember(Obj* obj) {
+    if (qvm.remembered_capacity <= qvm.remembered_size + 1) {
+        qvm.remembered_capacity = GROW_CAPACITY(qvm.remembered_capacity);
+        qvm.remembered = (Obj**) realloc(qvm.remembered, sizeof(Obj*) * qvm.remembered_capacity);
+        if (qvm.remembered == NULL) {
+            exit(1);
+        }
+    }
+    obj->is_remembered = true;
+    qvm.remembered[qvm.remembered_size++] = obj;
+}
+
+// While running, errors unwind straight to the handler set up in
+// qvm_execute, so the interpreter loop does not need to check for them.
 void runtime_error(const char* message) {
     qvm.had_runtime_error = true;
     printf("%s\n", message);
+    if (qvm.is_running) {
+        longjmp(qvm.error_handler, 1);
+    }
 }
 
-static inline void call_native(ObjNative* native, uint8_t param_count) {
-    Value* params = (Value*) malloc(sizeof(Value) * param_count);
-    for (int i = param_count - 1; i >= 0; i--) {
-        int distance_to_peek = param_count - (i + 1);
-        params[i] = stack_peek(distance_to_peek);
+// Entering a frame makes room for the most values its function can hold
+// (see chunk_max_stack), plus NATIVE_STACK_RESERVE for the natives it
+// calls and for the objects the allocator pushes to keep them reachable.
+// After that nothing pushed while the frame runs needs a bounds check.
+static inline void enter_frame(ObjFunction* fn, ObjClosure* closure, Value* slots, Value* result) {
+    if (qvm.frame_count == qvm.frame_capacity) {
+        grow_frames();
     }
-    Value result = native->function(param_count, params);
-    free(params);
-
-    for (int i = 0; i < param_count; i++) {
-        stack_pop();
+    qvm.frame_count++;
+    CallFrame* frame = &qvm.frames[qvm.frame_count - 1];
+    frame->func = fn;
+    frame->closure = closure;
+    frame->pc = fn->chunk.code;
+    frame->slots = slots;
+    frame->result = result;
+    qvm.frame = frame;
+    int needed = (int) (slots - qvm.stack) + fn->max_stack + NATIVE_STACK_RESERVE;
+    if (needed > qvm.stack_capacity) {
+        grow_stack(needed);
     }
-    stack_pop(); // pop obj native value from stack
-    stack_push(result);
 }
 
-static inline ObjFunction* prepare_binded_method(ObjBindedMethod* binded, uint8_t param_count) {
-    stack_push(OBJ_VALUE(binded->instance, binded->instance->type));
-    assert(OBJ_IS_FUNCTION(binded->method));
-    return OBJ_AS_FUNCTION(binded->method);
+// Natives get their arguments straight from the stack (see native.h). The
+// frame of the caller reserved room for their temporaries, so the stack
+// cannot move under argv.
+static inline void call_native(ObjNative* native, uint8_t param_count) {
+    Value* argv = qvm.stack_top - param_count;
+    Value result = native->function(param_count, argv);
+    qvm.stack_top = argv - 1; // pop arguments and obj native value
+    *(qvm.stack_top++) = result;
 }
 
+// The self of a binded method goes after the arguments. The compiler
+// counted that push in the frame of the caller.
 static inline void call_function(Obj* obj, Value* slots, uint8_t param_count) {
-    if (obj->kind == OBJ_NATIVE) {
-        call_native(OBJ_AS_NATIVE(obj), param_count);
+    switch (obj->kind) {
+    case OBJ_FUNCTION:
+        enter_frame(OBJ_AS_FUNCTION(obj), NULL, slots, slots);
+        return;
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = OBJ_AS_CLOSURE(obj);
+        enter_frame(closure->function, closure, slots, slots);
         return;
     }
-
-    if (qvm.frame_count + 1 >= FRAMES_MAX) {
-        runtime_error("Frame overflow");
+    case OBJ_BINDED_METHOD: {
+        ObjBindedMethod* binded = OBJ_AS_BINDED_METHOD(obj);
+        assert(OBJ_IS_FUNCTION(binded->method));
+        stack_push(OBJ_VALUE(binded->instance));
+        enter_frame(OBJ_AS_FUNCTION(binded->method), NULL, slots, slots);
         return;
     }
-
-    ObjFunction* fn = NULL;
-    if (obj->kind == OBJ_BINDED_METHOD) {
-        fn = prepare_binded_method(OBJ_AS_BINDED_METHOD(obj), param_count);
-        param_count++;
-        slots = (qvm.stack_top - param_count - 1);
-    } else {
-        assert(OBJ_IS_FUNCTION(obj));
-        fn = OBJ_AS_FUNCTION(obj);
+    default:
+        assert(OBJ_IS_NATIVE(obj));
+        call_native(OBJ_AS_NATIVE(obj), param_count);
+        return;
     }
-
-    qvm.frame_count++;
-    qvm.frame = &qvm.frames[qvm.frame_count - 1];
-    qvm.frame->func = fn;
-    qvm.frame->pc = fn->chunk.code;
-    qvm.frame->slots = slots;
 }
 
 static inline void call(uint8_t param_count) {
@@ -146,23 +379,30 @@ static inline void call(uint8_t param_count) {
     call_function(obj, slots, param_count);
 }
 
+// The callee of OP_CALL_DIRECT comes from the instruction and it is never
+// pushed, so there is nothing to check. Slot 0 of the frame is the value
+// below the arguments: functions do not use it, and the result is left
+// where the first argument was.
+static inline void call_direct(ObjFunction* fn, uint8_t param_count) {
+    Value* args = qvm.stack_top - param_count;
+    enter_frame(fn, NULL, args - 1, args);
+}
+
 static inline void invoke(uint8_t prop_index, uint8_t param_count) {
-    Value* slots = (qvm.stack_top - param_count - 1);
-    Value instance_value = *slots;
+    Value instance_value = stack_peek(param_count);
 
     Obj* instance = VALUE_AS_OBJ(instance_value);
     Value fn_value = object_get_property(instance, prop_index);
     Obj* fn = VALUE_AS_OBJ(fn_value);
 
     stack_push(instance_value); // Push self
-    call_function(fn, slots, ++param_count);
+    param_count++;
+    Value* slots = (qvm.stack_top - param_count - 1);
+    call_function(fn, slots, param_count);
 }
 
+// The running frame reserved room for every push (see enter_frame).
 void stack_push(Value val) {
-    if ((qvm.stack_top - qvm.stack) + 1 >= STACK_MAX) {
-        runtime_error("Stack overflow");
-        return;
-    }
     *(qvm.stack_top++) = val;
 }
 
@@ -174,72 +414,190 @@ static inline Value stack_peek(uint8_t distance) {
     return *(qvm.stack_top - distance - 1);
 }
 
+// Inside run() the program counter, the slots and constants of the current
+// frame and the stack top are kept in locals, so they can live in registers.
+// STORE_STATE() writes them back before anything outside run() may look at
+// them: calls, returns, allocations (the GC walks the stack) and errors.
+#define STORE_STATE()\
+    do {\
+        frame->pc = pc;\
+        qvm.stack_top = stack_top;\
+    } while (false)
+
+#define LOAD_STATE()\
+    do {\
+        frame = qvm.frame;\
+        pc = frame->pc;\
+        slots = frame->slots;\
+        constants = frame->func->chunk.constants.values;\
+        stack_top = qvm.stack_top;\
+    } while (false)
+
+// The collector only runs here, between instructions, where every live
+// object is reachable from the stack, the frames or the globals: the
+// nursery collection moves objects, and natives and opcode handlers keep
+// raw pointers to them. Allocating just asks for a collection. Loops and
+// calls are safepoints, so a running program reaches one soon.
+#define GC_SAFEPOINT()\
+    do {\
+        if (qvm.gc_requested) {\
+            STORE_STATE();\
+            qvm_collect_garbage();\
+        }\
+    } while (false)
+
+#define PUSH(val) (*(stack_top++) = (val))
+
+#define POP() (*(--stack_top))
+#define DROP() (stack_top--)
+#define PEEK(distance) (*(stack_top - (distance) - 1))
+
+// Open upvalues at or above last are closed when their slots go away.
+#define CLOSE_UPVALUES(last)\
+    do {\
+        if (qvm.open_upvalues != NULL && qvm.open_upvalues->location >= (last)) {\
+            qvm_close_upvalues(last);\
+        }\
+    } while (false)
+
+// Continues the running function in native code once it is hot, or right
+// away when the function comes with code translated by --emit-c. Native
+// code does not check the stack size either: the frame has room for it.
+#define JIT_ENTER()\
+    do {\
+        if (qvm.jit && jit_is_hot(frame->func)) {\
+            Chunk* chunk = &frame->func->chunk;\
+            JitState state = {\
+                .slots = slots,\
+                .stack_top = stack_top,\
+                .constants = constants,\
+                .globals = globals,\
+                .func = frame->func,\
+                .closure = frame->closure,\
+            };\
+            pc = chunk->code + jit_run(frame->func->jit, &state, pc - chunk->code);\
+            stack_top = state.stack_top;\
+        }\
+    } while (false)
+
+// Binary operations leave the result where the first operand was.
 #define NUM_BINARY_OP(op)\
-    double b = VALUE_AS_NUMBER(stack_pop());\
-    double a = VALUE_AS_NUMBER(stack_pop());\
-    stack_push(NUMBER_VALUE(a op b))
+    double b = VALUE_AS_NUMBER(POP());\
+    double a = VALUE_AS_NUMBER(PEEK(0));\
+    PEEK(0) = NUMBER_VALUE(a op b)
+
+#define NUM_COMPARE_OP(op)\
+    double b = VALUE_AS_NUMBER(POP());\
+    double a = VALUE_AS_NUMBER(PEEK(0));\
+    PEEK(0) = BOOL_VALUE(a op b)
 
 #define BOOL_BINARY_OP(op)\
-    bool b = VALUE_AS_BOOL(stack_pop());\
-    bool a = VALUE_AS_BOOL(stack_pop());\
-    stack_push(BOOL_VALUE(a op b))
+    bool b = VALUE_AS_BOOL(POP());\
+    bool a = VALUE_AS_BOOL(PEEK(0));\
+    PEEK(0) = BOOL_VALUE(a op b)
 
 #define STRING_CONCAT()\
-    ObjString* b = OBJ_AS_STRING(VALUE_AS_OBJ(stack_peek(0)));\
-    ObjString* a = OBJ_AS_STRING(VALUE_AS_OBJ(stack_peek(1)));\
+    STORE_STATE();\
+    ObjString* b = OBJ_AS_STRING(VALUE_AS_OBJ(PEEK(0)));\
+    ObjString* a = OBJ_AS_STRING(VALUE_AS_OBJ(PEEK(1)));\
     ObjString* concat = concat_string(a, b);\
-    Value val = OBJ_VALUE(concat, CREATE_TYPE_STRING());\
-    stack_pop();\
-    stack_pop();\
-    stack_push(val)
+    Value val = OBJ_VALUE(concat);\
+    DROP();\
+    DROP();\
+    PUSH(val)
 
 #define CONSTANT_OP(read)\
     Value val = read();\
-    stack_push(val)
+    PUSH(val)
 
-#define DEFINE_GLOBAL_OP(str_read)\
-    ObjString* identifier = str_read();\
-    table_set(&qvm.globals, identifier, stack_peek(0));\
-    stack_pop()
+#define DEFINE_GLOBAL_OP(read)\
+    globals[read()] = POP()
 
-#define SET_GLOBAL_OP(str_read)\
-    ObjString* identifier = str_read();\
-    table_set(&qvm.globals, identifier, stack_peek(0))
+#define SET_GLOBAL_OP(read)\
+    globals[read()] = PEEK(0)
 
-#define GET_GLOBAL_OP(str_read)\
-    ObjString* identifier = str_read();\
-    stack_push(table_find(&qvm.globals, identifier))
+#define GET_GLOBAL_OP(read)\
+    PUSH(globals[read()])
 
-#define READ_BYTE() *(qvm.frame->pc++)
-#define READ_LONG() read_long(&qvm.frame->pc)
+#define READ_BYTE() (*(pc++))
+#define READ_LONG() (pc += 2, (uint16_t) ((pc[-2] << 8) | pc[-1]))
 
-#define READ_CONSTANT() qvm.frame->func->chunk.constants.values[READ_BYTE()]
-#define READ_STRING() OBJ_AS_STRING(VALUE_AS_OBJ(READ_CONSTANT()))
+#define READ_CONSTANT() constants[READ_BYTE()]
+#define READ_CONSTANT_LONG() constants[READ_LONG()]
 
-#define READ_CONSTANT_LONG() qvm.frame->func->chunk.constants.values[READ_LONG()]
-#define READ_STRING_LONG() OBJ_AS_STRING(VALUE_AS_OBJ(READ_CONSTANT_LONG()))
+#define READ_TYPE() (VECTOR_AS_TYPES(&frame->func->chunk.types)[READ_BYTE()])
 
-#define READ_GLOBAL_CONSTANT() qvm.frames[0].func->chunk.constants.values[READ_BYTE()]
-#define READ_GLOBAL_STRING() OBJ_AS_STRING(VALUE_AS_OBJ(READ_GLOBAL_CONSTANT()))
-
-#define READ_GLOBAL_CONSTANT_LONG() qvm.frames[0].func->chunk.constants.values[READ_LONG()]
-#define READ_GLOBAL_STRING_LONG() OBJ_AS_STRING(VALUE_AS_OBJ(READ_GLOBAL_CONSTANT_LONG()))
-
-#define GOTO(pos) do { qvm.frame->pc = &qvm.frame->func->chunk.code[pos]; } while(false)
+// Jumps if the comparison of the two numbers on top of the stack is false.
+#define JUMP_IF_NOT(op)\
+    double b = VALUE_AS_NUMBER(POP());\
+    double a = VALUE_AS_NUMBER(POP());\
+    uint16_t offset = READ_LONG();\
+    if (! (a op b)) {\
+        pc += offset;\
+    }
 
 #define ABORT_IF_NIL(val)\
     do {\
         if (VALUE_IS_NIL(val)) {\
+            STORE_STATE();\
             runtime_error("Null pointer object!");\
-            return;\
         }\
     } while (false)
 
-static inline Type* read_type() {
-    uint8_t index = READ_BYTE();
-    Type** types = VECTOR_AS_TYPES(&qvm.frame->func->chunk.types);
-    return types[index];
-}
+// With labels as values (GCC and Clang) every opcode handler ends jumping
+// straight to the next handler through dispatch_table, so each opcode gets its
+// own indirect branch instead of sharing the one of the switch. Define
+// SWITCH_DISPATCH (make DISPATCH=switch) to use the portable switch loop.
+#if !defined(SWITCH_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define THREADED_DISPATCH
+#endif
+
+#ifdef VM_DEBUG
+#define TRACE_BEFORE() opcode_print(*pc)
+#define TRACE_AFTER()\
+    do {\
+        printf("\t");\
+        stack_print(stack_top, qvm.stack);\
+        printf("\n\n");\
+        valuearray_print(&qvm.globals);\
+    } while (false)
+#else
+#define TRACE_BEFORE()
+#define TRACE_AFTER()
+#endif
+
+#ifdef PROFILE_OPS
+// Counts (and optionally times) every executed opcode when --profile-ops
+// is given. Build with -D PROFILE_OPS (make profile) to get it.
+#define COUNT_OPCODE()\
+    do {\
+        if (op_profile.enabled) {\
+            op_profile_count(*pc);\
+        }\
+    } while (false)
+#else
+#define COUNT_OPCODE()
+#endif
+
+#ifdef THREADED_DISPATCH
+// __extension__ keeps -Wpedantic quiet about labels as values.
+#define CASE(op) LABEL_##op
+#define LABEL_ADDRESS(op) __extension__ &&LABEL_##op
+#define DISPATCH()\
+    do {\
+        TRACE_BEFORE();\
+        COUNT_OPCODE();\
+        __extension__ ({ goto *dispatch_table[READ_BYTE()]; });\
+    } while (false)
+#define NEXT()\
+    do {\
+        TRACE_AFTER();\
+        DISPATCH();\
+    } while (false)
+#else
+#define CASE(op) case op
+#define NEXT() break
+#endif
 
 static void run(ObjFunction* func) {
 #ifdef VM_DEBUG
@@ -249,287 +607,506 @@ static void run(ObjFunction* func) {
     qvm.frame = &qvm.frames[qvm.frame_count - 1];
     qvm.frame->func = func;
 
+    CallFrame* frame;
+    uint8_t* pc;
+    Value* slots;
+    Value* constants;
+    Value* stack_top;
+    LOAD_STATE();
+    // The compiler allocated every global slot, so this never moves.
+    Value* globals = qvm.globals.values;
+    JIT_ENTER();
+
+#ifdef THREADED_DISPATCH
+    static const void* dispatch_table[] = {
+        [OP_ADD_NUM] = LABEL_ADDRESS(OP_ADD_NUM),
+        [OP_SUB] = LABEL_ADDRESS(OP_SUB),
+        [OP_MUL] = LABEL_ADDRESS(OP_MUL),
+        [OP_DIV] = LABEL_ADDRESS(OP_DIV),
+        [OP_NEGATE] = LABEL_ADDRESS(OP_NEGATE),
+        [OP_CONCAT_STR] = LABEL_ADDRESS(OP_CONCAT_STR),
+        [OP_AND] = LABEL_ADDRESS(OP_AND),
+        [OP_OR] = LABEL_ADDRESS(OP_OR),
+        [OP_NOT] = LABEL_ADDRESS(OP_NOT),
+        [OP_MOD] = LABEL_ADDRESS(OP_MOD),
+        [OP_NOP] = LABEL_ADDRESS(OP_NOP),
+        [OP_TRUE] = LABEL_ADDRESS(OP_TRUE),
+        [OP_FALSE] = LABEL_ADDRESS(OP_FALSE),
+        [OP_NIL] = LABEL_ADDRESS(OP_NIL),
+        [OP_EQUAL] = LABEL_ADDRESS(OP_EQUAL),
+        [OP_EQUAL_NUM] = LABEL_ADDRESS(OP_EQUAL_NUM),
+        [OP_EQUAL_BOOL] = LABEL_ADDRESS(OP_EQUAL_BOOL),
+        [OP_EQUAL_REF] = LABEL_ADDRESS(OP_EQUAL_REF),
+        [OP_NOT_EQUAL] = LABEL_ADDRESS(OP_NOT_EQUAL),
+        [OP_NOT_EQUAL_NUM] = LABEL_ADDRESS(OP_NOT_EQUAL_NUM),
+        [OP_NOT_EQUAL_BOOL] = LABEL_ADDRESS(OP_NOT_EQUAL_BOOL),
+        [OP_NOT_EQUAL_REF] = LABEL_ADDRESS(OP_NOT_EQUAL_REF),
+        [OP_GREATER] = LABEL_ADDRESS(OP_GREATER),
+        [OP_LOWER] = LABEL_ADDRESS(OP_LOWER),
+        [OP_GREATER_EQUAL] = LABEL_ADDRESS(OP_GREATER_EQUAL),
+        [OP_LOWER_EQUAL] = LABEL_ADDRESS(OP_LOWER_EQUAL),
+        [OP_CONSTANT] = LABEL_ADDRESS(OP_CONSTANT),
+        [OP_CONSTANT_LONG] = LABEL_ADDRESS(OP_CONSTANT_LONG),
+        [OP_DEFINE_GLOBAL] = LABEL_ADDRESS(OP_DEFINE_GLOBAL),
+        [OP_DEFINE_GLOBAL_LONG] = LABEL_ADDRESS(OP_DEFINE_GLOBAL_LONG),
+        [OP_SET_GLOBAL] = LABEL_ADDRESS(OP_SET_GLOBAL),
+        [OP_SET_GLOBAL_LONG] = LABEL_ADDRESS(OP_SET_GLOBAL_LONG),
+        [OP_GET_GLOBAL] = LABEL_ADDRESS(OP_GET_GLOBAL),
+        [OP_GET_GLOBAL_LONG] = LABEL_ADDRESS(OP_GET_GLOBAL_LONG),
+        [OP_GET_LOCAL] = LABEL_ADDRESS(OP_GET_LOCAL),
+        [OP_SET_LOCAL] = LABEL_ADDRESS(OP_SET_LOCAL),
+        [OP_GET_LOCALS] = LABEL_ADDRESS(OP_GET_LOCALS),
+        [OP_GET_LOCAL_CONSTANT] = LABEL_ADDRESS(OP_GET_LOCAL_CONSTANT),
+        [OP_SET_LOCAL_POP] = LABEL_ADDRESS(OP_SET_LOCAL_POP),
+        [OP_INCREMENT_LOCAL] = LABEL_ADDRESS(OP_INCREMENT_LOCAL),
+        [OP_SET_UPVALUE] = LABEL_ADDRESS(OP_SET_UPVALUE),
+        [OP_GET_UPVALUE] = LABEL_ADDRESS(OP_GET_UPVALUE),
+        [OP_CALL] = LABEL_ADDRESS(OP_CALL),
+        [OP_CALL_DIRECT] = LABEL_ADDRESS(OP_CALL_DIRECT),
+        [OP_TAIL_CALL] = LABEL_ADDRESS(OP_TAIL_CALL),
+        [OP_POP] = LABEL_ADDRESS(OP_POP),
+        [OP_RETURN] = LABEL_ADDRESS(OP_RETURN),
+        [OP_END] = LABEL_ADDRESS(OP_END),
+        [OP_CLOSURE] = LABEL_ADDRESS(OP_CLOSURE),
+        [OP_CLOSE_UPVALUES] = LABEL_ADDRESS(OP_CLOSE_UPVALUES),
+        [OP_JUMP] = LABEL_ADDRESS(OP_JUMP),
+        [OP_JUMP_IF_FALSE] = LABEL_ADDRESS(OP_JUMP_IF_FALSE),
+        [OP_LOOP] = LABEL_ADDRESS(OP_LOOP),
+        [OP_JUMP_IF_NOT_LOWER] = LABEL_ADDRESS(OP_JUMP_IF_NOT_LOWER),
+        [OP_JUMP_IF_NOT_LOWER_EQUAL] = LABEL_ADDRESS(OP_JUMP_IF_NOT_LOWER_EQUAL),
+        [OP_JUMP_IF_NOT_GREATER] = LABEL_ADDRESS(OP_JUMP_IF_NOT_GREATER),
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = LABEL_ADDRESS(OP_JUMP_IF_NOT_GREATER_EQUAL),
+        [OP_JUMP_IF_NOT_EQUAL] = LABEL_ADDRESS(OP_JUMP_IF_NOT_EQUAL),
+        [OP_JUMP_IF_EQUAL] = LABEL_ADDRESS(OP_JUMP_IF_EQUAL),
+        [OP_NEW] = LABEL_ADDRESS(OP_NEW),
+        [OP_INVOKE] = LABEL_ADDRESS(OP_INVOKE),
+        [OP_GET_PROP] = LABEL_ADDRESS(OP_GET_PROP),
+        [OP_SET_PROP] = LABEL_ADDRESS(OP_SET_PROP),
+        [OP_BINDED_METHOD] = LABEL_ADDRESS(OP_BINDED_METHOD),
+        [OP_ARRAY] = LABEL_ADDRESS(OP_ARRAY),
+        [OP_ARRAY_PUSH] = LABEL_ADDRESS(OP_ARRAY_PUSH),
+        [OP_CAST] = LABEL_ADDRESS(OP_CAST),
+    };
+    DISPATCH();
+#else
     for (;;) {
-        if (qvm.had_runtime_error) {
-            return;
-        }
-#ifdef VM_DEBUG
-        opcode_print(*qvm.frame->pc);
-#endif
+        TRACE_BEFORE();
+        COUNT_OPCODE();
         switch (READ_BYTE()) {
-        case OP_ADD: {
-            Value second = stack_peek(0);
-            Value first = stack_peek(1);
-            if (TYPE_IS_STRING(first.type) && TYPE_IS_STRING(second.type)) {
-                STRING_CONCAT();
-                break;
-            }
+#endif
+        CASE(OP_ADD_NUM): {
             NUM_BINARY_OP(+);
-            break;
+            NEXT();
+        }
+        CASE(OP_CONCAT_STR): {
+            STRING_CONCAT();
+            NEXT();
         }
-        case OP_SUB: {
+        CASE(OP_SUB): {
             NUM_BINARY_OP(-);
-            break;
+            NEXT();
         }
-        case OP_MUL: {
+        CASE(OP_MUL): {
             NUM_BINARY_OP(*);
-            break;
+            NEXT();
         }
-        case OP_DIV: {
+        CASE(OP_DIV): {
             NUM_BINARY_OP(/);
-            break;
+            NEXT();
         }
-        case OP_NEGATE: {
-            Value val = *(qvm.stack_top - 1);
+        CASE(OP_NEGATE): {
+            Value val = PEEK(0);
             double d = VALUE_AS_NUMBER(val);
-            *(qvm.stack_top - 1) = NUMBER_VALUE(d * -1);
-            break;
+            PEEK(0) = NUMBER_VALUE(d * -1);
+            NEXT();
         }
-        case OP_AND: {
+        CASE(OP_AND): {
             BOOL_BINARY_OP(&&);
-            break;
+            NEXT();
         }
-        case OP_OR: {
+        CASE(OP_OR): {
             BOOL_BINARY_OP(||);
-            break;
-        }
-        case OP_NOT: {
-            bool a = VALUE_AS_BOOL(stack_pop());
-            stack_push(BOOL_VALUE(!a));
-            break;
-        }
-        case OP_MOD: {
-            double b = VALUE_AS_NUMBER(stack_pop());
-            double a = VALUE_AS_NUMBER(stack_pop());
-            stack_push(NUMBER_VALUE(fmod(a, b)));
-            break;
-        }
-        case OP_NOP:
-            break;
-        case OP_TRUE: {
-            stack_push(BOOL_VALUE(true));
-            break;
-        }
-        case OP_FALSE: {
-            stack_push(BOOL_VALUE(false));
-            break;
-        }
-        case OP_NIL: {
-            stack_push(NIL_VALUE());
-            break;
-        }
-        case OP_EQUAL: {
-            Value b = stack_pop();
-            Value a = stack_pop();
+            NEXT();
+        }
+        CASE(OP_NOT): {
+            bool a = VALUE_AS_BOOL(PEEK(0));
+            PEEK(0) = BOOL_VALUE(!a);
+            NEXT();
+        }
+        CASE(OP_MOD): {
+            double b = VALUE_AS_NUMBER(POP());
+            double a = VALUE_AS_NUMBER(PEEK(0));
+            PEEK(0) = NUMBER_VALUE(fmod(a, b));
+            NEXT();
+        }
+        CASE(OP_NOP):
+            NEXT();
+        CASE(OP_TRUE): {
+            PUSH(BOOL_VALUE(true));
+            NEXT();
+        }
+        CASE(OP_FALSE): {
+            PUSH(BOOL_VALUE(false));
+            NEXT();
+        }
+        CASE(OP_NIL): {
+            PUSH(NIL_VALUE());
+            NEXT();
+        }
+        CASE(OP_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            bool result = value_equals(a, b);
+            PUSH(BOOL_VALUE(result));
+            NEXT();
+        }
+        CASE(OP_EQUAL_NUM): {
+            NUM_COMPARE_OP(==);
+            NEXT();
+        }
+        CASE(OP_EQUAL_BOOL): {
+            BOOL_BINARY_OP(==);
+            NEXT();
+        }
+        CASE(OP_EQUAL_REF): {
+            // Strings are interned, so they are equal only if they are
+            // the same object
+            Value b = POP();
+            PEEK(0) = BOOL_VALUE(VALUE_SAME(PEEK(0), b));
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL): {
+            Value b = POP();
+            Value a = POP();
             bool result = value_equals(a, b);
-            stack_push(BOOL_VALUE(result));
-            break;
-        }
-        case OP_GREATER: {
-            double b = VALUE_AS_NUMBER(stack_pop());
-            double a = VALUE_AS_NUMBER(stack_pop());
-            stack_push(BOOL_VALUE(a > b));
-            break;
-        }
-        case OP_LOWER: {
-            double b = VALUE_AS_NUMBER(stack_pop());
-            double a = VALUE_AS_NUMBER(stack_pop());
-            stack_push(BOOL_VALUE(a < b));
-            break;
-        }
-        case OP_CONSTANT: {
+            PUSH(BOOL_VALUE(!result));
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL_NUM): {
+            NUM_COMPARE_OP(!=);
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL_BOOL): {
+            BOOL_BINARY_OP(!=);
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL_REF): {
+            Value b = POP();
+            PEEK(0) = BOOL_VALUE(! VALUE_SAME(PEEK(0), b));
+            NEXT();
+        }
+        CASE(OP_GREATER): {
+            NUM_COMPARE_OP(>);
+            NEXT();
+        }
+        CASE(OP_LOWER): {
+            NUM_COMPARE_OP(<);
+            NEXT();
+        }
+        CASE(OP_GREATER_EQUAL): {
+            NUM_COMPARE_OP(>=);
+            NEXT();
+        }
+        CASE(OP_LOWER_EQUAL): {
+            NUM_COMPARE_OP(<=);
+            NEXT();
+        }
+        CASE(OP_CONSTANT): {
             CONSTANT_OP(READ_CONSTANT);
-            break;
+            NEXT();
         }
-        case OP_CONSTANT_LONG: {
+        CASE(OP_CONSTANT_LONG): {
             CONSTANT_OP(READ_CONSTANT_LONG);
-            break;
+            NEXT();
         }
-        case OP_DEFINE_GLOBAL: {
-            DEFINE_GLOBAL_OP(READ_STRING);
-            break;
+        CASE(OP_DEFINE_GLOBAL): {
+            DEFINE_GLOBAL_OP(READ_BYTE);
+            NEXT();
         }
-        case OP_DEFINE_GLOBAL_LONG: {
-            DEFINE_GLOBAL_OP(READ_STRING_LONG);
-            break;
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            DEFINE_GLOBAL_OP(READ_LONG);
+            NEXT();
         }
-        case OP_SET_GLOBAL: {
-            SET_GLOBAL_OP(READ_GLOBAL_STRING);
-            break;
+        CASE(OP_SET_GLOBAL): {
+            SET_GLOBAL_OP(READ_BYTE);
+            NEXT();
         }
-        case OP_SET_GLOBAL_LONG: {
-            SET_GLOBAL_OP(READ_GLOBAL_STRING_LONG);
-            break;
+        CASE(OP_SET_GLOBAL_LONG): {
+            SET_GLOBAL_OP(READ_LONG);
+            NEXT();
         }
-        case OP_GET_GLOBAL: {
-            GET_GLOBAL_OP(READ_GLOBAL_STRING);
-            break;
+        CASE(OP_GET_GLOBAL): {
+            GET_GLOBAL_OP(READ_BYTE);
+            NEXT();
         }
-        case OP_GET_GLOBAL_LONG: {
-            GET_GLOBAL_OP(READ_GLOBAL_STRING_LONG);
-            break;
+        CASE(OP_GET_GLOBAL_LONG): {
+            GET_GLOBAL_OP(READ_LONG);
+            NEXT();
         }
-        case OP_GET_LOCAL: {
+        CASE(OP_GET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            stack_push(qvm.frame->slots[slot]);
-            break;
+            PUSH(slots[slot]);
+            NEXT();
         }
-        case OP_SET_LOCAL: {
+        CASE(OP_SET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            qvm.frame->slots[slot] = stack_peek(0);
-            break;
+            slots[slot] = PEEK(0);
+            NEXT();
+        }
+        CASE(OP_GET_LOCALS): {
+            uint8_t a = READ_BYTE();
+            uint8_t b = READ_BYTE();
+            PUSH(slots[a]);
+            PUSH(slots[b]);
+            NEXT();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            PUSH(READ_CONSTANT());
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            NEXT();
+        }
+        CASE(OP_INCREMENT_LOCAL): {
+            Value* local = &slots[READ_BYTE()];
+            *local = NUMBER_VALUE(VALUE_AS_NUMBER(*local) + VALUE_AS_NUMBER(READ_CONSTANT()));
+            NEXT();
         }
-        case OP_SET_UPVALUE: {
-            Value* target = function_get_upvalue(qvm.frame->func, READ_BYTE());
-            *target = stack_peek(0);
-            break;
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = PEEK(0);
+            qvm_write_barrier((Obj*) upvalue, PEEK(0));
+            NEXT();
         }
-        case OP_GET_UPVALUE: {
-            Value* readed = function_get_upvalue(qvm.frame->func, READ_BYTE());
-            stack_push(*readed);
-            break;
+        CASE(OP_GET_UPVALUE): {
+            Value* readed = frame->closure->upvalues[READ_BYTE()]->location;
+            PUSH(*readed);
+            NEXT();
         }
-        case OP_CALL: {
+        CASE(OP_CALL): {
             uint8_t param_count = READ_BYTE();
+            GC_SAFEPOINT();
+            STORE_STATE();
             call(param_count);
-            break;
+            LOAD_STATE();
+            JIT_ENTER();
+            NEXT();
         }
-        case OP_POP: {
-            stack_pop();
-            break;
+        CASE(OP_CALL_DIRECT): {
+            ObjFunction* function = OBJ_AS_FUNCTION(VALUE_AS_OBJ(READ_CONSTANT_LONG()));
+            uint8_t param_count = READ_BYTE();
+            GC_SAFEPOINT();
+            STORE_STATE();
+            call_direct(function, param_count);
+            LOAD_STATE();
+            JIT_ENTER();
+            NEXT();
         }
-        case OP_RETURN: {
-            Value return_val = stack_pop();
-            while (qvm.stack_top != qvm.frame->slots) {
-                stack_pop();
+        CASE(OP_TAIL_CALL): {
+            uint8_t param_count = READ_BYTE();
+            GC_SAFEPOINT();
+            Value* callee = stack_top - param_count - 1;
+            Obj* obj = VALUE_AS_OBJ(callee[0]);
+            if (obj->kind != OBJ_FUNCTION && obj->kind != OBJ_CLOSURE) {
+                // Natives and binded methods are called as usual and the
+                // next OP_RETURN returns their result.
+                STORE_STATE();
+                call(param_count);
+                LOAD_STATE();
+                NEXT();
+            }
+            // Move the arguments over the current frame and restart it. Slot 0
+            // is kept: in a direct call it belongs to the caller.
+            CLOSE_UPVALUES(slots + 1);
+            memmove(slots + 1, callee + 1, sizeof(Value) * param_count);
+            stack_top = slots + param_count + 1;
+            if (obj->kind == OBJ_CLOSURE) {
+                frame->closure = OBJ_AS_CLOSURE(obj);
+                frame->func = frame->closure->function;
+            } else {
+                frame->closure = NULL;
+                frame->func = OBJ_AS_FUNCTION(obj);
             }
-            stack_push(return_val);
+            pc = frame->func->chunk.code;
+            constants = frame->func->chunk.constants.values;
+            // The new function may need more room than the old one
+            int needed = (int) (slots - qvm.stack) + frame->func->max_stack + NATIVE_STACK_RESERVE;
+            if (needed > qvm.stack_capacity) {
+                STORE_STATE();
+                grow_stack(needed);
+                LOAD_STATE();
+            }
+            JIT_ENTER();
+            NEXT();
+        }
+        CASE(OP_POP): {
+            DROP();
+            NEXT();
+        }
+        CASE(OP_RETURN): {
+            Value return_val = POP();
+            CLOSE_UPVALUES(slots + 1);
+            *frame->result = return_val;
+            stack_top = frame->result + 1;
+            qvm.stack_top = stack_top;
             qvm.frame_count--;
             qvm.frame = &qvm.frames[qvm.frame_count - 1];
-            break;
+            LOAD_STATE();
+            JIT_ENTER();
+            NEXT();
         }
-        case OP_END: {
+        CASE(OP_END): {
+            STORE_STATE();
             return;
         }
-        case OP_BIND_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            uint8_t upvalue = READ_BYTE();
-            Value* stack_ptr = &qvm.frame->slots[slot];
-            Obj* function_obj = VALUE_AS_OBJ(stack_pop());
-            ObjFunction* function = OBJ_AS_FUNCTION(function_obj);
-            function_open_upvalue(function, upvalue, stack_ptr);
-            break;
-        }
-        case OP_CLOSE: {
-            Value val = stack_pop();
-            ObjClosed* closed = new_closed(val);
-            // TODO Which type should be for a ObjClosed?
-            Value obj_closed = OBJ_VALUE(closed, CREATE_TYPE_UNKNOWN());
-            stack_push(obj_closed);
-            break;
-        }
-        case OP_BIND_CLOSED: {
-            uint8_t upvalue = READ_BYTE();
-            Obj* function_obj = VALUE_AS_OBJ(stack_pop());
-            ObjFunction* function = OBJ_AS_FUNCTION(function_obj);
-            Obj* closed_obj = VALUE_AS_OBJ(stack_peek(0));
-            ObjClosed* closed = OBJ_AS_CLOSED(closed_obj);
-            function_close_upvalue(function, upvalue, closed);
-            break;
-        }
-        case OP_JUMP: {
-            GOTO(READ_LONG());
-            break;
-        }
-        case OP_JUMP_IF_FALSE: {
-            Value condition = stack_pop();
-            uint8_t dst = READ_LONG();
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = OBJ_AS_FUNCTION(VALUE_AS_OBJ(READ_CONSTANT_LONG()));
+            STORE_STATE();
+            qvm_push_closure(function);
+            LOAD_STATE();
+            NEXT();
+        }
+        CASE(OP_CLOSE_UPVALUES): {
+            Value* last = &slots[READ_BYTE()];
+            CLOSE_UPVALUES(last);
+            NEXT();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_LONG();
+            pc += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            Value condition = POP();
+            uint16_t offset = READ_LONG();
             if (! VALUE_AS_BOOL(condition)) {
-                GOTO(dst);
+                pc += offset;
             }
-            break;
+            NEXT();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_LONG();
+            pc -= offset;
+            GC_SAFEPOINT();
+            JIT_ENTER();
+            NEXT();
         }
-        case OP_NEW: {
-            Value val = stack_pop();
+        CASE(OP_JUMP_IF_NOT_LOWER): {
+            JUMP_IF_NOT(<);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_LOWER_EQUAL): {
+            JUMP_IF_NOT(<=);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER): {
+            JUMP_IF_NOT(>);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER_EQUAL): {
+            JUMP_IF_NOT(>=);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL): {
+            JUMP_IF_NOT(==);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_EQUAL): {
+            JUMP_IF_NOT(!=);
+            NEXT();
+        }
+        CASE(OP_NEW): {
+            Value val = POP();
             ObjClass* klass = OBJ_AS_CLASS(VALUE_AS_OBJ(val));
+            STORE_STATE();
             ObjInstance* instance = new_instance(klass);
-            stack_push(OBJ_VALUE(instance, klass->obj.type)); // This is to assign to the var
-            stack_push(OBJ_VALUE(instance, klass->obj.type)); // This is to call init (or to be POPed)
-            break;
+            PUSH(OBJ_VALUE(instance)); // This is to assign to the var
+            PUSH(OBJ_VALUE(instance)); // This is to call init (or to be POPed)
+            NEXT();
         }
-        case OP_INVOKE: {
+        CASE(OP_INVOKE): {
             uint8_t prop_index = READ_BYTE();
             uint8_t params = READ_BYTE();
+            GC_SAFEPOINT();
+            STORE_STATE();
             invoke(prop_index, params);
-            break;
+            LOAD_STATE();
+            JIT_ENTER();
+            NEXT();
         }
-        case OP_GET_PROP: {
-            Value val = stack_pop();
+        CASE(OP_GET_PROP): {
+            Value val = POP();
             ABORT_IF_NIL(val);
             Obj* instance = VALUE_AS_OBJ(val);
             uint8_t pos = READ_BYTE();
-            stack_push(object_get_property(instance, pos));
-            break;
+            PUSH(object_get_property(instance, pos));
+            NEXT();
         }
-        case OP_SET_PROP: {
-            Value val = stack_pop();
+        CASE(OP_SET_PROP): {
+            Value val = POP();
             // This is an expression, so something should be in the stack
             // to be popped later.
-            Value obj_val = stack_peek(0);
+            Value obj_val = PEEK(0);
             ABORT_IF_NIL(obj_val);
             Obj* instance = VALUE_AS_OBJ(obj_val);
             uint8_t pos = READ_BYTE();
             object_set_property(instance, pos, val);
-            break;
+            NEXT();
         }
-        case OP_BINDED_METHOD: {
-            Value val = stack_peek(0);
+        CASE(OP_BINDED_METHOD): {
+            Value val = PEEK(0);
             ABORT_IF_NIL(val);
             Obj* instance = VALUE_AS_OBJ(val);
             uint8_t pos = READ_BYTE();
             Value method = object_get_property(instance, pos);
+            STORE_STATE();
             ObjBindedMethod* binded = new_binded_method(instance, VALUE_AS_OBJ(method));
-            stack_pop(); // Now its safe to pop the instance
-            stack_push(OBJ_VALUE(binded, binded->obj.type));
-            break;
+            DROP(); // Now its safe to pop the instance
+            PUSH(OBJ_VALUE(binded));
+            NEXT();
         }
-        case OP_ARRAY: {
-            Type* inner = read_type();
+        CASE(OP_ARRAY): {
+            Type* inner = READ_TYPE();
+            STORE_STATE();
             ObjArray* arr = new_array(inner);
-            stack_push(OBJ_VALUE(arr, arr->obj.type));
+            PUSH(OBJ_VALUE(arr));
             // Just let the array in the top of the stack.
-            break;
+            NEXT();
         }
-        case OP_ARRAY_PUSH: {
-            Value val = stack_pop();
-            Value target = stack_peek(0);
+        CASE(OP_ARRAY_PUSH): {
+            Value val = POP();
+            Value target = PEEK(0);
             ObjArray* arr = OBJ_AS_ARRAY(VALUE_AS_OBJ(target));
+            STORE_STATE();
+            qvm_write_barrier((Obj*) arr, val);
             valuearray_write(&arr->elements, val);
-            break;
+            NEXT();
         }
-        case OP_CAST: {
-            Value value = stack_pop();
-            Type* cast = read_type();
-            stack_push(value_cast(value, cast));
-            break;
+        CASE(OP_CAST): {
+            Value value = POP();
+            Type* cast = READ_TYPE();
+            STORE_STATE();
+            PUSH(value_cast(value, cast));
+            NEXT();
         }
+#ifndef THREADED_DISPATCH
         }
-#ifdef VM_DEBUG
-        printf("\t");
-        stack_print(qvm.stack_top, qvm.stack);
-        printf("\n\n");
-        table_print(&qvm.globals);
-#endif
+        TRACE_AFTER();
     }
+#endif
 #undef READ_BYTE
 }
 
 void qvm_execute(ObjFunction* func) {
-    stack_push(OBJ_VALUE(func, create_type_function()));
-    CallFrame* frame = &qvm.frames[qvm.frame_count++];
-    frame->func = func;
-    frame->pc = func->chunk.code;
-    frame->slots = qvm.stack;
+    stack_push(OBJ_VALUE(func));
     qvm.is_running = true;
-    run(func);
+    if (setjmp(qvm.error_handler) == 0) {
+        enter_frame(func, NULL, qvm.stack, qvm.stack);
+        run(func);
+    }
+    qvm.is_running = false;
 }
@@ -1,41 +1,131 @@
 #ifndef QUARTZ_VM_H_
 #define QUARTZ_VM_H_
 
+#include <setjmp.h>
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
+#include "heap.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX FRAMES_MAX * 2
+// The value stack and the frame stack start small and grow on demand up
+// to qvm.max_stack values and qvm.max_frames frames.
+#define STACK_INITIAL 256
+#define FRAMES_INITIAL 64
+#define STACK_LIMIT (1 << 20)
+#define FRAMES_LIMIT (1 << 16)
+
+// Objects are born in the nursery while the program runs, and the ones
+// bigger than NURSERY_MAX_OBJECT go straight to the old generation (see
+// qvm_alloc_object).
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT 1024
+
+// Microseconds a collection may pause the program by default, and the
+// environment variable that sets it (see --gc-pause in qcc.c). With 0 the
+// whole heap is collected at once.
+#define GC_DEFAULT_PAUSE 1000
+#define GC_PAUSE_ENV "QUARTZ_GC_PAUSE"
+
+// The pacer sets the trigger of each cycle so the collection of the old
+// generation takes about GC_DEFAULT_OVERHEAD percent of the time, and
+// tries to keep the heap under a soft limit, in megabytes, if there is
+// one (see --gc-overhead and --gc-heap-limit in qcc.c).
+#define GC_DEFAULT_OVERHEAD 10
+#define GC_OVERHEAD_ENV "QUARTZ_GC_OVERHEAD"
+#define GC_HEAP_LIMIT_ENV "QUARTZ_GC_HEAP_LIMIT"
+
+// Pauses are counted by power of two of their microseconds
+#define GC_PAUSE_BUCKETS 24
+
+// Triggers set by the last cycles that are kept in qvm.gc_stats
+#define GC_TRIGGER_HISTORY 16
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GcState;
+
+// Counters of the collector. They are always kept, and written as JSON
+// by format_gc_stats (see --gc-stats and the stdgc import). Bytes count
+// the nursery too: every object in it is freed when it is emptied, and
+// the survivors are allocated again in the old generation.
+typedef struct {
+    uint64_t minor_collections;
+    uint64_t major_collections; // Cycles of the old generation started
+    uint64_t pause_micros; // Of every pause together
+    uint64_t bytes_allocated;
+    uint64_t bytes_freed;
+    uint64_t bytes_promoted;
+    // The old generation when the last mark ended, and what was left of
+    // it without the objects found dead and what they own
+    size_t marked_heap_bytes;
+    size_t live_bytes;
+    uint64_t objects_allocated[OBJ_KIND_COUNT];
+    uint64_t objects_freed[OBJ_KIND_COUNT];
+    size_t triggers[GC_TRIGGER_HISTORY]; // By cycle, oldest first once full
+    uint64_t trigger_count;
+} GcStats;
 
 typedef struct {
     ObjFunction* func;
+    ObjClosure* closure; // NULL when the function has no upvalues
     uint8_t* pc;
     Value* slots;
+    // Where the return value goes: slot 0, or the first argument of a
+    // direct call, whose slot 0 is the value of the caller below them.
+    Value* result;
 } CallFrame;
 
 typedef struct {
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stack_top;
+    int stack_capacity;
+    int max_stack;
 
-    Obj* objects;
+    uint8_t* nursery;
+    uint8_t* nursery_top;
+    ObjUpvalue* open_upvalues; // Sorted by stack slot, the highest first
 
     Table strings;
-    Table globals;
+    ValueArray globals;
 
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frame_count;
+    int frame_capacity;
+    int max_frames;
     CallFrame* frame;
 
     Obj** gray_stack;
     int gray_stack_capacity;
     int gray_stack_size;
 
+    // Old objects that may point to young ones
+    Obj** remembered;
+    int remembered_capacity;
+    int remembered_size;
+
     bool is_running;
     bool had_runtime_error;
+    bool jit;
+    jmp_buf error_handler;
 
     size_t bytes_allocated;
     size_t next_gc_trigger;
+    bool gc_requested; // Collect at the next safepoint of run()
+    bool gc_full_requested; // And collect the whole heap then
+
+    // The old generation is collected incrementally (see vm_memory.c)
+    GcState gc_state;
+    size_t gc_allocated; // Bytes allocated since the last collection
+    size_t gc_debt; // Bytes of marking or sweeping owed by the program
+    int gc_pause_budget;
+    int gc_threads; // Marking threads, the interpreter one included
+    int gc_overhead; // Percent of the time the collector aims to take
+    size_t gc_heap_limit; // Soft, in bytes. 0 when there is none
+    uint64_t gc_pauses[GC_PAUSE_BUCKETS];
+    uint64_t gc_max_pause;
+    GcStats gc_stats;
 } QVM;
 
 void init_qvm();
@@ -43,10 +133,36 @@ void free_qvm();
 void stack_push(Value val);
 Value stack_pop();
 void qvm_execute(ObjFunction* func);
+int qvm_new_global();
+void qvm_push_closure(ObjFunction* function);
+void qvm_close_upvalues(Value* last);
 void qvm_push_gray(Obj* obj);
 Obj* qvm_pop_gray();
+void qvm_remember(Obj* obj);
 void runtime_error(const char* message);
 
 extern QVM qvm;
 
+#define QVM_IS_YOUNG(obj) ((uintptr_t) (obj) - (uintptr_t) qvm.nursery < NURSERY_SIZE)
+
+// Every store of a value into an object goes through the barrier. It
+// remembers old objects that get young values, so the nursery collection
+// finds them without walking the old generation, and while the old
+// generation is being marked it shades the value stored (Dijkstra), so
+// no black object points to a white one. Globals, the stack and the
+// frames are roots and need none.
+static inline void qvm_write_barrier(Obj* owner, Value value) {
+    if (! VALUE_IS_OBJ(value)) {
+        return;
+    }
+    Obj* obj = VALUE_AS_OBJ(value);
+    if (QVM_IS_YOUNG(obj)) {
+        if (! QVM_IS_YOUNG(owner) && ! owner->is_remembered) {
+            qvm_remember(owner);
+        }
+    } else if (qvm.gc_state == GC_MARKING && ! heap_is_marked(obj)) {
+        mark_object(obj);
+    }
+}
+
 #endif
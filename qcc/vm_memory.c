@@ -1,44 +1,142 @@
 #include "vm_memory.h"
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
 #include "common.h"
 #include "object.h"
 #include "vm.h"
 #include "table.h"
 #include "string.h"
 #include "array.h"
+#include "jit.h"
+#include "gc_threads.h"
+#include "heap.h"
 
 #ifdef GC_DEBUG
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Bounds of the trigger the pacer chooses. The old generation starts a
+// cycle at GC_MIN_HEAP at the earliest, and grows at least by a nursery
+// between cycles, as that much may be promoted by a single minor
+// collection. It grows at most GC_MAX_GROWTH times what survived.
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_MIN_GROWTH NURSERY_SIZE
+#define GC_MAX_GROWTH 3
 
+// While a cycle runs the program owes GC_STEP_RATIO bytes of marking or
+// sweeping for each byte it allocates, and pays them every GC_SLICE_BYTES.
+#define GC_STEP_RATIO 2
+#define GC_SLICE_BYTES (64 * 1024)
+
+// The pause budget is checked every GC_STEPS_PER_CLOCK objects
+#define GC_STEPS_PER_CLOCK 32
+
+// Smaller heaps are marked faster than the marking threads wake up.
+// Under STRESS_GC every heap is marked by them.
+#define GC_PARALLEL_MIN_HEAP (1024 * 1024)
+
+// Objects in the nursery are 8 byte aligned, one after the other, so it
+// can be walked from start to top.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+static void collect_old_generation(uint64_t start);
 static void collect_garbage();
+static void collect_everything();
+static void collect_slice(uint64_t start);
+static void collect_nursery();
+static void promote_roots();
+static Obj* promote(Obj* obj);
+static void scavenge_object(Obj* obj);
+static void sweep_nursery();
+
+static void start_cycle();
+static size_t gc_step();
+static size_t mark_step();
+static void finish_marking();
+static size_t sweep_step();
+static void finish_cycle();
 
-static void mark();
 static void mark_roots();
 static void mark_stack();
 static void mark_globals();
 static void mark_callframes();
+static void mark_open_upvalues();
 
 static void trace_objects();
 static void blacken_object(Obj* obj);
 
-static void sweep();
+static void background_sweep();
+static void join_background_sweep();
+static void finish_sweep();
 
-#define GC_CAN_RUN() (qvm.is_running)
+static void charge_phase(uint64_t now);
+static size_t pace_cycle(size_t live, size_t heap);
+static void record_pause(uint64_t micros);
 
-void* qvm_realloc(void* ptr, size_t old_size, size_t size) {
+// When the sweep runs in the background thread nothing in qvm is touched
+// until it is joined: what the dead objects owned is counted apart, in
+// sweep_freed and sweep_objects_freed. Their slots are counted by the
+// heap (see heap_take_freed).
+static size_t sweep_freed = 0;
+static uint64_t sweep_objects_freed[OBJ_KIND_COUNT];
+// The trigger for the next cycle, chosen by the pacer when the last mark
+// ended (see pace_cycle)
+static size_t cycle_trigger = 0;
+
+// What the pacer measures from the end of a mark to the end of the next.
+// Only the work done in the pauses is timed: the allocator and the
+// background thread sweep while the program runs.
+typedef struct {
+    uint64_t phase_started; // Since when the work in the pause is not charged
+    uint64_t mark_micros;
+    uint64_t sweep_micros;
+    size_t swept; // Bytes of pages swept in the pauses
+    size_t allocated; // Bytes allocated in the old generation
+    uint64_t marked_at; // When the last mark ended
+    uint64_t paused; // qvm.gc_stats.pause_micros then
+    double sweep_cost; // Microseconds per byte swept, by the last sweeps
+} Pacer;
+
+static Pacer pacer;
+static _Thread_local bool in_sweeper = false;
+
+static void count_allocation(size_t old_size, size_t size) {
     qvm.bytes_allocated += size - old_size;
+    if (size > old_size) {
+        qvm.gc_allocated += size - old_size;
+        qvm.gc_stats.bytes_allocated += size - old_size;
+        pacer.allocated += size - old_size;
+    } else {
+        qvm.gc_stats.bytes_freed += old_size - size;
+    }
 #ifdef STRESS_GC
-    printf("Oldsize %d, size %d\n", old_size, size);
-    if (size > old_size && GC_CAN_RUN()) {
-        collect_garbage();
+    printf("Oldsize %zu, size %zu\n", old_size, size);
+    if (size > old_size) {
+        qvm.gc_requested = true;
     }
 #else
-    if (qvm.bytes_allocated > qvm.next_gc_trigger && GC_CAN_RUN()) {
-        collect_garbage();
+    if (qvm.bytes_allocated > qvm.next_gc_trigger) {
+        qvm.gc_requested = true;
     }
 #endif
+}
+
+static void count_freed(size_t size) {
+    qvm.bytes_allocated -= size;
+    qvm.gc_stats.bytes_freed += size;
+}
+
+// Allocating never collects: the collector moves young objects, so it
+// only runs at the safepoints of the interpreter (see GC_SAFEPOINT in vm.c).
+void* qvm_realloc(void* ptr, size_t old_size, size_t size) {
+    if (in_sweeper) {
+        assert(size == 0);
+        sweep_freed += old_size;
+        free(ptr);
+        return NULL;
+    }
+    count_allocation(old_size, size);
     if (size == 0) {
         free(ptr);
         return NULL;
@@ -46,68 +144,195 @@ void* qvm_realloc(void* ptr, size_t old_size, size_t size) {
     return realloc(ptr, size);
 }
 
-static void free_object(Obj* obj) {
+// While the program runs objects are bump allocated in the nursery. The
+// big ones, the ones that do not fit until the next safepoint empties it
+// and the ones of the compiler go to the old generation. Those allocated
+// while running are remembered, as they may get young values while they
+// are initialized, and while the old generation is being marked they
+// start gray: they are traced once initialized, in a later slice.
+void* qvm_alloc_object(size_t size) {
+    size_t aligned = NURSERY_ALIGN(size);
+    if (qvm.is_running && aligned <= NURSERY_MAX_OBJECT) {
+        if (qvm.nursery_top + aligned <= qvm.nursery + NURSERY_SIZE) {
+            Obj* obj = (Obj*) qvm.nursery_top;
+            qvm.nursery_top += aligned;
+            qvm.gc_allocated += aligned;
+            qvm.gc_stats.bytes_allocated += aligned;
+            obj->is_remembered = false;
+            obj->is_forwarded = false;
+#ifdef STRESS_GC
+            qvm.gc_requested = true;
+#endif
+            return obj;
+        }
+        qvm.gc_requested = true;
+    }
+    Obj* obj = heap_alloc(size);
+    count_allocation(0, heap_size_of(size));
+    obj->is_remembered = false;
+    obj->is_forwarded = false;
+    if (qvm.is_running) {
+        qvm_remember(obj);
+    }
+    if (qvm.gc_state == GC_MARKING) {
+        heap_set_mark(obj);
+        qvm_push_gray(obj);
+    }
+    return obj;
+}
+
+// Frees what the object owns besides its own memory.
+static void free_object_data(Obj* obj) {
+    if (in_sweeper) {
+        sweep_objects_freed[obj->kind]++;
+    } else {
+        qvm.gc_stats.objects_freed[obj->kind]++;
+    }
     free_valuearray(&obj->props);
     switch (obj->kind) {
-    case OBJ_STRING: {
-        FREE(ObjString, obj);
-        break;
-    }
     case OBJ_FUNCTION: {
         ObjFunction* func = OBJ_AS_FUNCTION(obj);
         free_chunk(&func->chunk);
-        FREE(ObjFunction, obj);
+        free_jit_code(func->jit);
         break;
     }
-    case OBJ_CLOSED: {
-        FREE(ObjClosed, obj);
+    case OBJ_ARRAY: {
+        ObjArray* arr = OBJ_AS_ARRAY(obj);
+        free_valuearray(&arr->elements);
         break;
     }
-    case OBJ_NATIVE: {
-        FREE(ObjNative, obj);
+    default:
         break;
     }
-    case OBJ_CLASS: {
-        FREE(ObjClass, obj);
+}
+
+// Bytes of what free_object_data frees, as they were counted.
+static size_t object_data_size(Obj* obj) {
+    size_t size = obj->props.capacity * sizeof(Value);
+    switch (obj->kind) {
+    case OBJ_FUNCTION: {
+        Chunk* chunk = &OBJ_AS_FUNCTION(obj)->chunk;
+        size += chunk->capacity * (sizeof(uint8_t) + sizeof(int));
+        size += chunk->constants.capacity * sizeof(Value);
+        size += chunk->types.capacity * chunk->types.element_size;
         break;
     }
-    case OBJ_INSTANCE: {
-        FREE(ObjInstance, obj);
+    case OBJ_ARRAY:
+        size += OBJ_AS_ARRAY(obj)->elements.capacity * sizeof(Value);
         break;
-    }
-    case OBJ_BINDED_METHOD: {
-        FREE(ObjBindedMethod, obj);
+    default:
         break;
     }
-    case OBJ_ARRAY: {
-        ObjArray* arr = OBJ_AS_ARRAY(obj);
-        free_valuearray(&arr->elements);
-        FREE(ObjArray, arr);
-        break;
+    return size;
+}
+
+void free_objects() {
+    finish_sweep();
+    free_heap(free_object_data);
+    uint8_t* young = qvm.nursery;
+    while (young < qvm.nursery_top) {
+        Obj* obj = (Obj*) young;
+        young += NURSERY_ALIGN(object_size(obj));
+        free_object_data(obj);
     }
+    qvm.nursery_top = qvm.nursery;
+}
+
+static uint64_t now_micros() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+    return (uint64_t) clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+// Runs at the safepoints of the interpreter. The nursery is emptied every
+// time. Once the old generation reaches its trigger a cycle starts, and
+// each call does a slice of it that fits in the pause budget. Without
+// budget the whole cycle runs at once.
+void qvm_collect_garbage() {
+    uint64_t start = now_micros();
+    collect_nursery();
+    count_freed(heap_take_freed());
+    pacer.phase_started = now_micros();
+    if (qvm.gc_full_requested) {
+        collect_everything();
+        qvm.gc_full_requested = false;
+    } else {
+        collect_old_generation(start);
     }
+    qvm.gc_allocated = 0;
+    qvm.gc_requested = false;
+    uint64_t now = now_micros();
+    charge_phase(now);
+    record_pause(now - start);
 }
 
-void free_objects() {
-    Obj* current = qvm.objects;
-    Obj* next = NULL;
-    while (current != NULL) {
-        next = current->next;
-        free_object(current);
-        current = next;
+void init_gc_pacer() {
+    pacer.phase_started = 0;
+    pacer.mark_micros = 0;
+    pacer.sweep_micros = 0;
+    pacer.swept = 0;
+    pacer.allocated = 0;
+    pacer.marked_at = now_micros();
+    pacer.paused = 0;
+    pacer.sweep_cost = 0;
+    cycle_trigger = GC_MIN_HEAP;
+    qvm.next_gc_trigger = cycle_trigger;
+}
+
+// Starts a cycle of the old generation when it reaches its trigger, or
+// goes on with the one that is running.
+static void collect_old_generation(uint64_t start) {
+#ifdef STRESS_GC
+    bool start_now = true;
+#else
+    bool start_now = qvm.bytes_allocated > qvm.next_gc_trigger;
+#endif
+    // A new cycle waits for the sweep of the last one, which may also be
+    // done already, by the background thread or the allocator.
+    if (qvm.gc_state == GC_SWEEPING) {
+        bool swept = gc_background_running() ? gc_background_done() : heap_sweep_done();
+        if (start_now || swept) {
+            finish_sweep();
+#ifndef STRESS_GC
+            start_now = qvm.bytes_allocated > qvm.next_gc_trigger;
+#endif
+        }
+    }
+    if (qvm.gc_pause_budget == 0) {
+        if (start_now) {
+            collect_garbage();
+        }
+    } else {
+        if (qvm.gc_state == GC_IDLE && start_now) {
+            start_cycle();
+        }
+        if (qvm.gc_state != GC_IDLE && !gc_background_running()) {
+            collect_slice(start);
+        }
     }
 }
 
+// Runs the cycle that is going on, or a whole new one, until its marking
+// ends. The sweep is left to the allocator and the background thread.
 static void collect_garbage() {
 #ifdef GC_DEBUG
-    printf("-- gc begins\n");
     size_t before = qvm.bytes_allocated;
 #endif
-    qvm.next_gc_trigger = qvm.bytes_allocated * GC_HEAP_GROW_FACTOR;
-    mark();
-    sweep();
+    if (qvm.gc_state == GC_IDLE) {
+        start_cycle();
+    }
+    if (qvm.gc_state == GC_MARKING) {
+        // All at once, so the marking threads can share it
+        trace_objects();
+    }
+    while (qvm.gc_state == GC_MARKING) {
+        mark_step();
+    }
 #ifdef GC_DEBUG
-    printf("-- gc ends\n");
     printf(
         "   collected %zu bytes (from %zu to %zu) next at %zu\n",
         before - qvm.bytes_allocated,
@@ -117,18 +342,350 @@ static void collect_garbage() {
 #endif
 }
 
-static void mark() {
+// Runs the cycle going on and a whole new one, sweep included, so every
+// object that was dead when it was called is freed. The cycle going on
+// may keep some that died since it started.
+static void collect_everything() {
+    if (qvm.gc_state != GC_IDLE) {
+        collect_garbage();
+        finish_sweep();
+    }
+    collect_garbage();
+    finish_sweep();
+}
+
+// Asks for a collection of the whole heap at the next safepoint.
+void qvm_request_full_collection() {
+    qvm.gc_full_requested = true;
+    qvm.gc_requested = true;
+}
+
+// Bytes in use by the objects of both generations, counting the ones of
+// the old generation that are dead but not swept yet.
+size_t qvm_heap_size() {
+    count_freed(heap_take_freed());
+    return qvm.bytes_allocated + (qvm.nursery_top - qvm.nursery);
+}
+
+// Pays the work owed for what was allocated since the last slice, unless
+// the pause budget runs out first. Then what is left is owed to the next.
+static void collect_slice(uint64_t start) {
+#ifdef STRESS_GC
+    // Tiny slices, so the barrier is put to work across many of them
+    qvm.gc_debt = 1;
+#else
+    qvm.gc_debt += qvm.gc_allocated * GC_STEP_RATIO;
+#endif
+    size_t work = 0;
+    int steps = 0;
+    while (qvm.gc_state != GC_IDLE && !gc_background_running() && work < qvm.gc_debt) {
+        work += gc_step();
+        if (++steps % GC_STEPS_PER_CLOCK == 0 && now_micros() - start >= (uint64_t) qvm.gc_pause_budget) {
+            break;
+        }
+    }
+    if (qvm.gc_state == GC_IDLE || gc_background_running()) {
+        qvm.gc_debt = 0;
+        return;
+    }
+    qvm.gc_debt = (work < qvm.gc_debt) ? qvm.gc_debt - work : 0;
+    qvm.next_gc_trigger = qvm.bytes_allocated + GC_SLICE_BYTES;
+}
+
+// Minor collection. The young objects reachable from the roots or from
+// the remembered old objects are copied to the old generation, and the
+// nursery starts empty again. Besides the roots, it only touches the
+// survivors and the nursery, never the rest of the old generation.
+static void collect_nursery() {
+    qvm.gc_stats.minor_collections++;
+#ifdef GC_DEBUG
+    printf("-- minor gc begins\n");
+    size_t used = qvm.nursery_top - qvm.nursery;
+    size_t before = qvm.bytes_allocated;
+#endif
+    // The copies are queued above the gray objects of the old generation,
+    // and scanned in order. While the old generation is being marked they
+    // stay there, gray.
+    int base = qvm.gray_stack_size;
+    promote_roots();
+    for (int i = base; i < qvm.gray_stack_size; i++) {
+        scavenge_object(qvm.gray_stack[i]);
+    }
+    if (qvm.gc_state != GC_MARKING) {
+        qvm.gray_stack_size = base;
+    }
+    sweep_nursery();
 #ifdef GC_DEBUG
+    printf("-- minor gc ends\n");
+    printf(
+        "   emptied %zu bytes of nursery, promoted %zu bytes\n",
+        used,
+        qvm.bytes_allocated - before);
+#endif
+}
+
+static inline void forward_object(Obj** slot) {
+    if (QVM_IS_YOUNG(*slot)) {
+        *slot = promote(*slot);
+    }
+}
+
+static inline void forward_value(Value* slot) {
+    if (VALUE_IS_OBJ(*slot) && QVM_IS_YOUNG(VALUE_AS_OBJ(*slot))) {
+        *slot = OBJ_VALUE(promote(VALUE_AS_OBJ(*slot)));
+    }
+}
+
+static void forward_valuearray(ValueArray* const arr) {
+    for (int i = 0; i < arr->size; i++) {
+        forward_value(&arr->values[i]);
+    }
+}
+
+static void promote_roots() {
+    for (Value* current = qvm.stack; current != qvm.stack_top; current++) {
+        forward_value(current);
+    }
+    forward_valuearray(&qvm.globals);
+    for (int i = 0; i < qvm.frame_count; i++) {
+        forward_object((Obj**) &qvm.frames[i].func);
+        forward_object((Obj**) &qvm.frames[i].closure);
+    }
+    // Open upvalues are linked through their own memory, so the list is
+    // relinked as they move.
+    for (ObjUpvalue** link = &qvm.open_upvalues; *link != NULL; link = &(*link)->next) {
+        forward_object((Obj**) link);
+    }
+    for (int i = 0; i < qvm.remembered_size; i++) {
+        Obj* obj = qvm.remembered[i];
+        obj->is_remembered = false;
+        scavenge_object(obj);
+    }
+    qvm.remembered_size = 0;
+}
+
+// Copies a young object to the old generation the first time it is
+// reached and leaves the address of the copy in it. The copy is scanned
+// later, from the gray stack.
+static Obj* promote(Obj* obj) {
+    if (obj->is_forwarded) {
+        return obj->forward;
+    }
+    size_t size = object_size(obj);
+    Obj* copy = heap_alloc(size);
+    count_allocation(0, heap_size_of(size));
+    qvm.gc_stats.bytes_promoted += heap_size_of(size);
+    memcpy(copy, obj, size);
+    if (qvm.gc_state == GC_MARKING) {
+        heap_set_mark(copy);
+    }
+    if (obj->kind == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = OBJ_AS_UPVALUE(copy);
+        if (upvalue->location == &OBJ_AS_UPVALUE(obj)->closed) {
+            upvalue->location = &upvalue->closed;
+        }
+    }
+    obj->forward = copy;
+    obj->is_forwarded = true;
+    qvm_push_gray(copy);
+    return copy;
+}
+
+// Promotes the young objects an old one points to.
+static void scavenge_object(Obj* obj) {
+    forward_valuearray(&obj->props);
+    switch (obj->kind) {
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    case OBJ_FUNCTION: {
+        ObjFunction* fn = OBJ_AS_FUNCTION(obj);
+        forward_object((Obj**) &fn->name);
+        forward_valuearray(&fn->chunk.constants);
+        break;
+    }
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = OBJ_AS_UPVALUE(obj);
+        forward_value(&upvalue->closed);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = OBJ_AS_CLOSURE(obj);
+        forward_object((Obj**) &closure->function);
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            forward_object((Obj**) &closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass* klass = OBJ_AS_CLASS(obj);
+        forward_object((Obj**) &klass->name);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = OBJ_AS_INSTANCE(obj);
+        forward_object((Obj**) &instance->klass);
+        break;
+    }
+    case OBJ_BINDED_METHOD: {
+        ObjBindedMethod* binded = OBJ_AS_BINDED_METHOD(obj);
+        forward_object(&binded->instance);
+        forward_object(&binded->method);
+        break;
+    }
+    case OBJ_ARRAY: {
+        ObjArray* arr = OBJ_AS_ARRAY(obj);
+        forward_valuearray(&arr->elements);
+        break;
+    }
+    }
+}
+
+// Frees what the dead young objects owned, and points the interned
+// strings table to the copies of the strings that survived.
+static void sweep_nursery() {
+    uint8_t* current = qvm.nursery;
+    while (current < qvm.nursery_top) {
+        Obj* obj = (Obj*) current;
+        size_t size = NURSERY_ALIGN(object_size(obj));
+        current += size;
+        qvm.gc_stats.bytes_freed += size;
+        if (obj->is_forwarded) {
+            if (obj->kind == OBJ_STRING) {
+                table_move_key(&qvm.strings, OBJ_AS_STRING(obj), OBJ_AS_STRING(obj->forward));
+            }
+            continue;
+        }
+        if (obj->kind == OBJ_STRING) {
+            table_delete(&qvm.strings, OBJ_AS_STRING(obj));
+        }
+        free_object_data(obj);
+    }
+#ifdef STRESS_GC
+    // Anything left pointing into the nursery reads garbage from now on
+    memset(qvm.nursery, 0xAB, qvm.nursery_top - qvm.nursery);
+#endif
+    qvm.nursery_top = qvm.nursery;
+}
+
+// Tri-color cycle of the old generation. White objects are not marked,
+// gray ones are marked and in the gray stack, and black ones are marked
+// and traced. Slices only run right after the nursery was emptied, so
+// every object the cycle sees is old.
+static void start_cycle() {
+#ifdef GC_DEBUG
+    printf("-- gc begins\n");
     printf("-- gc start of mark phase\n");
 #endif
     // Compiler roots is not needed because the GC is not
     // running until the VM is not running (checking is_running
-    // field in VM)
+    // field in VM).
+    charge_phase(now_micros());
+    qvm.gc_state = GC_MARKING;
+    qvm.gc_stats.major_collections++;
+    mark_roots();
+}
+
+static size_t gc_step() {
+    if (qvm.gc_state == GC_MARKING) {
+        return mark_step();
+    }
+    return sweep_step();
+}
+
+static size_t mark_step() {
+    if (qvm.gray_stack_size == 0) {
+        finish_marking();
+        return 0;
+    }
+    Obj* obj = qvm_pop_gray();
+#ifdef GC_DEBUG
+    printf("   Tracing gray object: ");
+    print_object(obj);
+    printf("\n");
+#endif
+    blacken_object(obj);
+    return object_size(obj);
+}
+
+// The roots are not behind the write barrier, so they are marked again
+// before taking what is still white as garbage. Every page is left
+// unswept, and the allocator sweeps them as it needs them: the objects
+// allocated from now on go to swept pages, and are not part of the cycle.
+static void finish_marking() {
     mark_roots();
     trace_objects();
     table_delete_white(&qvm.strings);
 #ifdef GC_DEBUG
     printf("-- gc end of mark phase\n");
+    printf("-- gc start sweep\n");
+#endif
+    size_t garbage = heap_start_sweep(free_object_data, object_data_size);
+    charge_phase(now_micros());
+    // Until it is swept the heap still counts the garbage
+    qvm.gc_stats.marked_heap_bytes = qvm.bytes_allocated;
+    qvm.gc_stats.live_bytes = qvm.bytes_allocated - garbage;
+    cycle_trigger = pace_cycle(qvm.gc_stats.live_bytes, qvm.bytes_allocated);
+    qvm.next_gc_trigger = cycle_trigger;
+    GcStats* stats = &qvm.gc_stats;
+    stats->triggers[stats->trigger_count++ % GC_TRIGGER_HISTORY] = cycle_trigger;
+    sweep_freed = 0;
+    qvm.gc_state = GC_SWEEPING;
+    if (qvm.gc_threads > 1) {
+        gc_run_in_background(background_sweep);
+    }
+}
+
+// Runs in the background thread. The program can not reach the dead
+// objects and does not write the marks of the old ones, and the pages
+// are taken one at a time under the lock of the heap, so the allocator
+// sweeps the ones it needs meanwhile.
+static void background_sweep() {
+    in_sweeper = true;
+    while (heap_sweep_step() != 0) {
+    }
+    in_sweeper = false;
+}
+
+static void join_background_sweep() {
+    gc_join_background();
+    count_freed(sweep_freed);
+    sweep_freed = 0;
+    for (int i = 0; i < OBJ_KIND_COUNT; i++) {
+        qvm.gc_stats.objects_freed[i] += sweep_objects_freed[i];
+        sweep_objects_freed[i] = 0;
+    }
+}
+
+// Sweeps whatever is left of the sweep going on, if any.
+static void finish_sweep() {
+    if (gc_background_running()) {
+        join_background_sweep();
+    }
+    while (qvm.gc_state == GC_SWEEPING) {
+        sweep_step();
+    }
+}
+
+// Sweeps a page, or a big object.
+static size_t sweep_step() {
+    size_t work = heap_sweep_step();
+    pacer.swept += work;
+    if (work == 0) {
+        heap_finish_sweep();
+        finish_cycle();
+    }
+    return work;
+}
+
+static void finish_cycle() {
+    charge_phase(now_micros());
+    qvm.gc_state = GC_IDLE;
+    count_freed(heap_take_freed());
+    qvm.next_gc_trigger = cycle_trigger;
+#ifdef GC_DEBUG
+    printf("-- gc end sweep\n");
+    printf("-- gc ends\n");
 #endif
 }
 
@@ -139,6 +696,7 @@ static void mark_roots() {
     mark_stack();
     mark_globals();
     mark_callframes();
+    mark_open_upvalues();
     mark_array();
     mark_string();
 #ifdef GC_DEBUG
@@ -162,7 +720,7 @@ static void mark_globals() {
 #ifdef GC_DEBUG
     printf("\t-- gc start marking globals\n");
 #endif
-    mark_table(&qvm.globals);
+    mark_valuearray(&qvm.globals);
 #ifdef GC_DEBUG
     printf("\t-- gc end marking globals\n");
 #endif
@@ -174,16 +732,32 @@ static void mark_callframes() {
 #endif
     for (int i = 0; i < qvm.frame_count; i++) {
         mark_object((Obj*)qvm.frames[i].func);
+        mark_object((Obj*)qvm.frames[i].closure);
     }
 #ifdef GC_DEBUG
     printf("\t-- gc end marking callframes\n");
 #endif
 }
 
+// Open upvalues may outlive the closures that captured them, and they
+// must stay alive while they are in qvm.open_upvalues.
+static void mark_open_upvalues() {
+    for (ObjUpvalue* upvalue = qvm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        mark_object((Obj*)upvalue);
+    }
+}
+
 static void trace_objects() {
 #ifdef GC_DEBUG
     printf("-- gc start tracing\n");
 #endif
+    bool parallel = qvm.gc_threads > 1;
+#ifndef STRESS_GC
+    parallel = parallel && qvm.bytes_allocated >= GC_PARALLEL_MIN_HEAP;
+#endif
+    if (parallel && gc_mark_in_parallel(qvm.gc_threads, blacken_object)) {
+        return;
+    }
     while (qvm.gray_stack_size != 0) {
         Obj* current = qvm_pop_gray();
 #ifdef GC_DEBUG
@@ -208,17 +782,19 @@ static void blacken_object(Obj* obj) {
         ObjFunction* fn = OBJ_AS_FUNCTION(obj);
         mark_object((Obj*)fn->name);
         mark_valuearray(&fn->chunk.constants);
-        for (int i = 0; i < fn->upvalue_count; i++) {
-            Upvalue* current = &fn->upvalues[i];
-            if (current->is_closed) {
-                mark_object((Obj*)current->closed);
-            }
-        }
         break;
     }
-    case OBJ_CLOSED: {
-        ObjClosed* closed = OBJ_AS_CLOSED(obj);
-        mark_value(closed->value);
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = OBJ_AS_UPVALUE(obj);
+        mark_value(upvalue->closed);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = OBJ_AS_CLOSURE(obj);
+        mark_object((Obj*)closure->function);
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            mark_object((Obj*)closure->upvalues[i]);
+        }
         break;
     }
     case OBJ_CLASS: {
@@ -245,45 +821,195 @@ static void blacken_object(Obj* obj) {
     }
 }
 
-static void sweep() {
-#ifdef GC_DEBUG
-    printf("-- gc start sweep\n");
-#endif
-    if (qvm.objects == NULL) {
-        return;
+// Charges the work done in the pause since the last call to the phase
+// the cycle is in.
+static void charge_phase(uint64_t now) {
+    if (qvm.gc_state == GC_MARKING) {
+        pacer.mark_micros += now - pacer.phase_started;
+    } else if (qvm.gc_state == GC_SWEEPING) {
+        pacer.sweep_micros += now - pacer.phase_started;
     }
+    pacer.phase_started = now;
+}
 
-    if (qvm.objects->is_marked) {
-        qvm.objects->is_marked = false;
-    } else {
-#ifdef GC_DEBUG
-    printf("   Sweeping object : ");
-    print_object(qvm.objects);
-    printf("\n");
-#endif
-        Obj* next = qvm.objects->next;
-        free_object(qvm.objects);
-        qvm.objects = next;
+// Chooses the trigger of the next cycle once a mark ends. While the
+// program runs it allocates in the old generation at the rate measured
+// since the last mark, so letting the heap grow by G bytes buys G / rate
+// microseconds of it. The next cycle marks what survives, live plus the
+// part of G that survives at the rate this mark found, and sweeps live
+// plus G, at the costs measured in the pauses. The collector takes the
+// overhead fraction of the time when
+//
+//     cost(G) = G / rate * overhead / (1 - overhead)
+//
+// which is solved for G. When the collector is too slow for any G to
+// meet it, or G would be too big, the heap grows as much as allowed.
+static size_t pace_cycle(size_t live, size_t heap) {
+    uint64_t now = now_micros();
+    uint64_t paused = qvm.gc_stats.pause_micros - pacer.paused;
+    uint64_t elapsed = now - pacer.marked_at;
+    double running = (elapsed > paused) ? (double) (elapsed - paused) : 1;
+    double alloc_rate = pacer.allocated / running;
+    double mark_cost = (live > 0) ? pacer.mark_micros / (double) live : 0;
+    if (pacer.swept > 0) {
+        pacer.sweep_cost = pacer.sweep_micros / (double) pacer.swept;
     }
+    double survival = (heap > 0) ? (double) live / heap : 1;
+    double overhead = qvm.gc_overhead / 100.0;
 
-    Obj* prev = qvm.objects;
-    while (prev != NULL && prev->next != NULL) {
-        Obj* current = prev->next;
-        if (current->is_marked) {
-            current->is_marked = false;
-            prev = current;
+    // cost(G) = live * (mark_cost + sweep_cost) + G * (survival * mark_cost + sweep_cost)
+    double buys = alloc_rate * (1 - overhead) / overhead;
+    double fixed = live * (mark_cost + pacer.sweep_cost);
+    double per_byte = survival * mark_cost + pacer.sweep_cost;
+    double max_growth = (double) live * GC_MAX_GROWTH;
+    double growth = max_growth;
+    if (1 - buys * per_byte > 0) {
+        growth = buys * fixed / (1 - buys * per_byte);
+    }
+    if (growth > max_growth) {
+        growth = max_growth;
+    }
+    if (growth < GC_MIN_GROWTH) {
+        growth = GC_MIN_GROWTH;
+    }
+    size_t trigger = live + (size_t) growth;
+    if (trigger < GC_MIN_HEAP) {
+        trigger = GC_MIN_HEAP;
+    }
+    // Soft: the heap may still grow by the minimum over it
+    if (qvm.gc_heap_limit > 0 && trigger > qvm.gc_heap_limit) {
+        trigger = (qvm.gc_heap_limit > live + GC_MIN_GROWTH) ? qvm.gc_heap_limit : live + GC_MIN_GROWTH;
+    }
+
+    pacer.mark_micros = 0;
+    pacer.sweep_micros = 0;
+    pacer.swept = 0;
+    pacer.allocated = 0;
+    pacer.marked_at = now;
+    pacer.paused = qvm.gc_stats.pause_micros;
+    return trigger;
+}
+
+static void record_pause(uint64_t micros) {
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= ((uint64_t) 1 << bucket)) {
+        bucket++;
+    }
+    qvm.gc_pauses[bucket]++;
+    qvm.gc_stats.pause_micros += micros;
+    if (micros > qvm.gc_max_pause) {
+        qvm.gc_max_pause = micros;
+    }
+}
+
+// Histogram of the pauses of the collector, by power of two of their
+// microseconds.
+void print_gc_pauses(FILE* out) {
+    uint64_t total = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        total += qvm.gc_pauses[i];
+    }
+    fprintf(out, "-- gc pauses: %llu, max %llu us, budget %d us\n",
+        (unsigned long long) total,
+        (unsigned long long) qvm.gc_max_pause,
+        qvm.gc_pause_budget);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (qvm.gc_pauses[i] == 0) {
             continue;
         }
-#ifdef GC_DEBUG
-    printf("   Sweeping object : ");
-    print_object(current);
-    printf("\n");
-#endif
-        Obj* next = current->next;
-        free_object(current);
-        prev->next = next;
+        uint64_t from = (i == 0) ? 0 : (uint64_t) 1 << (i - 1);
+        fprintf(out, "%8llu - %8llu us: %llu\n",
+            (unsigned long long) from,
+            (unsigned long long) 1 << i,
+            (unsigned long long) qvm.gc_pauses[i]);
     }
-#ifdef GC_DEBUG
-    printf("-- gc end sweep\n");
-#endif
+}
+
+static const char* kind_names[OBJ_KIND_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_BINDED_METHOD] = "binded_method",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_NATIVE] = "native",
+    [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_ARRAY] = "array",
+};
+
+typedef struct {
+    char* buffer;
+    size_t size;
+    size_t length;
+} StatsWriter;
+
+// Appends like snprintf, counting what does not fit too.
+static void write_stats(StatsWriter* writer, const char* format, ...) {
+    size_t left = (writer->length < writer->size) ? writer->size - writer->length : 0;
+    va_list params;
+    va_start(params, format);
+    int written = vsnprintf((left > 0) ? writer->buffer + writer->length : NULL, left, format, params);
+    va_end(params);
+    if (written > 0) {
+        writer->length += written;
+    }
+}
+
+// Writes qvm.gc_stats as JSON, like snprintf: returns the length of the
+// whole text, even if only part of it fits in buffer.
+size_t format_gc_stats(char* buffer, size_t size) {
+    GcStats* stats = &qvm.gc_stats;
+    StatsWriter writer = (StatsWriter) {
+        .buffer = buffer,
+        .size = size,
+        .length = 0,
+    };
+    uint64_t pauses = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        pauses += qvm.gc_pauses[i];
+    }
+    write_stats(&writer, "{\"collections\": {\"minor\": %llu, \"major\": %llu}",
+        (unsigned long long) stats->minor_collections,
+        (unsigned long long) stats->major_collections);
+    write_stats(&writer, ", \"pauses\": {\"count\": %llu, \"total_us\": %llu, \"max_us\": %llu}",
+        (unsigned long long) pauses,
+        (unsigned long long) stats->pause_micros,
+        (unsigned long long) qvm.gc_max_pause);
+    write_stats(&writer, ", \"bytes\": {\"allocated\": %llu, \"freed\": %llu, \"promoted\": %llu, \"heap\": %zu}",
+        (unsigned long long) stats->bytes_allocated,
+        (unsigned long long) stats->bytes_freed,
+        (unsigned long long) stats->bytes_promoted,
+        qvm_heap_size());
+    write_stats(&writer, ", \"last_mark\": {\"heap\": %zu, \"live\": %zu}",
+        stats->marked_heap_bytes,
+        stats->live_bytes);
+    write_stats(&writer, ", \"objects\": {");
+    for (int i = 0; i < OBJ_KIND_COUNT; i++) {
+        write_stats(&writer, "%s\"%s\": {\"allocated\": %llu, \"freed\": %llu}",
+            (i == 0) ? "" : ", ",
+            kind_names[i],
+            (unsigned long long) stats->objects_allocated[i],
+            (unsigned long long) stats->objects_freed[i]);
+    }
+    write_stats(&writer, "}, \"overhead\": %d, \"heap_limit\": %zu", qvm.gc_overhead, qvm.gc_heap_limit);
+    write_stats(&writer, ", \"next_gc_trigger\": %zu, \"trigger_history\": [", qvm.next_gc_trigger);
+    uint64_t first = (stats->trigger_count > GC_TRIGGER_HISTORY) ? stats->trigger_count - GC_TRIGGER_HISTORY : 0;
+    for (uint64_t i = first; i < stats->trigger_count; i++) {
+        write_stats(&writer, "%s%zu",
+            (i == first) ? "" : ", ",
+            stats->triggers[i % GC_TRIGGER_HISTORY]);
+    }
+    write_stats(&writer, "]}");
+    return writer.length;
+}
+
+void print_gc_stats(FILE* out) {
+    size_t length = format_gc_stats(NULL, 0);
+    char* text = (char*) malloc(length + 1);
+    if (text == NULL) {
+        exit(1);
+    }
+    format_gc_stats(text, length + 1);
+    fprintf(out, "%s\n", text);
+    free(text);
 }
@@ -4,7 +4,15 @@
 #include "common.h"
 
 void* qvm_realloc(void* ptr, size_t old_size, size_t size);
+void* qvm_alloc_object(size_t size);
+void init_gc_pacer();
+void qvm_collect_garbage();
 void free_objects();
+void qvm_request_full_collection();
+size_t qvm_heap_size();
+void print_gc_pauses(FILE* out);
+size_t format_gc_stats(char* buffer, size_t size);
+void print_gc_stats(FILE* out);
 
 #define ALLOC(type, count) (type*) qvm_realloc(NULL, 0, sizeof(type) * count)
 